@@ -0,0 +1,360 @@
+
+#include "TinyTcl.h"
+
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+namespace tcl {
+
+  // -- Binary --
+
+  struct BinaryField
+  {
+    char type;
+    bool isUnsigned;
+    bool hasCount;
+    bool all;
+    bool overflow;
+    size_t count;
+  };
+
+  // Counts are sizes in bytes or elements, anything larger is a typo rather than a request
+  static const size_t MaxFieldCount = (size_t)1 << 28;
+
+  // Parses the next field of a format string, a type letter with an optional u flag and count or *
+  static bool nextField(std::string_view format, size_t & pos, BinaryField & field)
+  {
+    while (pos < format.size() && isspace(format[pos]))
+      ++pos;
+
+    if (pos >= format.size())
+      return false;
+
+    field.type = format[pos++];
+    field.isUnsigned = false;
+    field.hasCount = false;
+    field.all = false;
+    field.overflow = false;
+    field.count = 1;
+
+    if (pos < format.size() && format[pos] == 'u')
+    {
+      field.isUnsigned = true;
+      ++pos;
+    }
+
+    if (pos < format.size() && format[pos] == '*')
+    {
+      field.hasCount = true;
+      field.all = true;
+      ++pos;
+    }
+    else if (pos < format.size() && isdigit(format[pos]))
+    {
+      field.hasCount = true;
+      field.count = 0;
+      while (pos < format.size() && isdigit(format[pos]))
+      {
+        const size_t digit = format[pos++] - '0';
+        if (field.count > (MaxFieldCount - digit) / 10)
+          field.overflow = true;
+        else
+          field.count = field.count * 10 + digit;
+      }
+    }
+
+    return true;
+  }
+
+  static int fieldWidth(char type)
+  {
+    switch (type)
+    {
+      case 'c': return 1;
+      case 's': case 'S': return 2;
+      case 'i': case 'I': case 'f': case 'r': case 'R': return 4;
+      case 'w': case 'W': case 'd': case 'q': case 'Q': return 8;
+    }
+    return 0;
+  }
+
+  static ReturnCode countTooLarge(Context * ctx, BinaryField const& field)
+  {
+    return ctx->reportError(std::string("Count too large in field '") + field.type + "'");
+  }
+
+  // Padding and fixed width text grow the result by their count alone, so it is charged against the memory limit first
+  static ReturnCode chargeOutput(Context * ctx, std::string const& result, size_t extra)
+  {
+    if (ctx->limits.memory && result.size() + extra > ctx->limits.memory && !ctx->limitExceeded(LIMIT_MEMORY))
+      return RET_LIMIT;
+    return RET_OK;
+  }
+
+  static bool isFloat(char type)
+  {
+    return type == 'f' || type == 'r' || type == 'R' || type == 'd' || type == 'q' || type == 'Q';
+  }
+
+  static bool nativeLittleEndian()
+  {
+    const uint16_t probe = 1;
+    return *reinterpret_cast<const unsigned char *>(&probe) == 1;
+  }
+
+  // Lower case types are little endian, upper case big endian, f and d use the native order
+  static bool fieldLittleEndian(char type)
+  {
+    if (type == 'f' || type == 'd')
+      return nativeLittleEndian();
+    return islower(type) != 0;
+  }
+
+  static void putBytes(unsigned char * out, uint64_t bits, int width, bool little)
+  {
+    for (int i = 0; i < width; ++i)
+      out[little ? i : width - 1 - i] = (unsigned char)(bits >> (8 * i));
+  }
+
+  static uint64_t getBytes(const unsigned char * in, int width, bool little)
+  {
+    uint64_t bits = 0;
+    for (int i = 0; i < width; ++i)
+      bits |= (uint64_t)in[little ? i : width - 1 - i] << (8 * i);
+    return bits;
+  }
+
+  static bool encodeNumber(Context * ctx, char type, Value const& value, unsigned char * out)
+  {
+    const int width = fieldWidth(type);
+    uint64_t bits;
+
+    if (isFloat(type))
+    {
+      double d;
+      if (!value.asDouble(d))
+      {
+        ctx->reportError("Expected number but got '" + value.str() + "'");
+        return false;
+      }
+
+      if (width == 4)
+      {
+        float f = (float)d;
+        uint32_t b;
+        memcpy(&b, &f, 4);
+        bits = b;
+      }
+      else
+        memcpy(&bits, &d, 8);
+    }
+    else
+    {
+      int64_t i;
+      double d;
+      if (!value.asInt(i))
+      {
+        if (!value.asDouble(d))
+        {
+          ctx->reportError("Expected integer but got '" + value.str() + "'");
+          return false;
+        }
+        i = (int64_t)d;
+      }
+      bits = (uint64_t)i;
+    }
+
+    putBytes(out, bits, width, fieldLittleEndian(type));
+    return true;
+  }
+
+  static Value decodeNumber(BinaryField const& field, const unsigned char * in)
+  {
+    const int width = fieldWidth(field.type);
+    uint64_t bits = getBytes(in, width, fieldLittleEndian(field.type));
+
+    if (isFloat(field.type))
+    {
+      if (width == 4)
+      {
+        uint32_t b = (uint32_t)bits;
+        float f;
+        memcpy(&f, &b, 4);
+        return Value::fromDouble(f);
+      }
+
+      double d;
+      memcpy(&d, &bits, 8);
+      return Value::fromDouble(d);
+    }
+
+    // Sign extend unless the field was marked unsigned
+    if (!field.isUnsigned && width < 8 && (bits >> (8 * width - 1)) & 1)
+      bits |= ~(uint64_t)0 << (8 * width);
+
+    return Value::fromInt((int64_t)bits);
+  }
+
+  // binary format formatString ?arg ...?
+  ReturnCode binaryFormat(Context * ctx, ArgumentVector const& args)
+  {
+    std::string_view format = args[2].view();
+    std::string result;
+    size_t next = 3;
+    size_t pos = 0;
+    BinaryField field;
+
+    while (nextField(format, pos, field))
+    {
+      if (field.overflow)
+        return countTooLarge(ctx, field);
+
+      if (field.type == 'x')
+      {
+        if (field.all)
+          continue;
+
+        if (chargeOutput(ctx, result, field.count) != RET_OK)
+          return RET_LIMIT;
+        result.append(field.count, '\0');
+        continue;
+      }
+
+      if (next >= args.size())
+        return ctx->reportError("Not enough arguments for all format specifiers");
+
+      Value const& arg = args[next++];
+
+      if (field.type == 'a' || field.type == 'A')
+      {
+        std::string_view text = arg.view();
+        size_t length = field.all ? text.size() : field.count;
+        if (chargeOutput(ctx, result, length) != RET_OK)
+          return RET_LIMIT;
+
+        result.append(text.data(), std::min(length, text.size()));
+        if (length > text.size())
+          result.append(length - text.size(), field.type == 'a' ? '\0' : ' ');
+        continue;
+      }
+
+      const int width = fieldWidth(field.type);
+      if (width == 0)
+        return ctx->reportError(std::string("Bad field specifier '") + field.type + "'");
+
+      // Without a count the argument is a single number, otherwise a list of them
+      if (!field.hasCount)
+      {
+        size_t offset = result.size();
+        result.resize(offset + width);
+        if (!encodeNumber(ctx, field.type, arg, (unsigned char *)&result[offset]))
+          return RET_ERROR;
+        continue;
+      }
+
+      std::vector<Value> const& list = arg.asList();
+      size_t count = field.all ? list.size() : field.count;
+      if (count > list.size())
+        return ctx->reportError("Number of elements in list does not match count");
+
+      size_t offset = result.size();
+      result.resize(offset + count * width);
+      unsigned char * out = (unsigned char *)&result[offset];
+
+      for (size_t i = 0; i < count; ++i, out += width)
+        if (!encodeNumber(ctx, field.type, list[i], out))
+          return RET_ERROR;
+    }
+
+    if (next != args.size())
+      return ctx->reportError("Extra arguments to 'binary format'");
+
+    ctx->current().result = Value(std::move(result));
+    return RET_OK;
+  }
+
+  // binary scan value formatString ?varName ...?, returns the number of variables set
+  ReturnCode binaryScan(Context * ctx, ArgumentVector const& args)
+  {
+    std::string_view data = args[2].view();
+    std::string_view format = args[3].view();
+    const unsigned char * bytes = (const unsigned char *)data.data();
+    size_t next = 4;
+    size_t cursor = 0;
+    size_t pos = 0;
+    int64_t converted = 0;
+    BinaryField field;
+
+    while (nextField(format, pos, field))
+    {
+      if (field.overflow)
+        return countTooLarge(ctx, field);
+
+      const size_t left = data.size() - cursor;
+
+      if (field.type == 'x')
+      {
+        cursor += field.all ? left : std::min(field.count, left);
+        continue;
+      }
+
+      if (next >= args.size())
+        return ctx->reportError("Not enough arguments for all format specifiers");
+
+      std::string const& name = args[next++].str();
+
+      if (field.type == 'a' || field.type == 'A')
+      {
+        size_t length = field.all ? left : field.count;
+        if (length > left)
+          break;
+
+        Value text = args[2].slice(cursor, length);
+        if (field.type == 'A')
+        {
+          std::string_view view = text.view();
+          while (!view.empty() && (view.back() == ' ' || view.back() == '\0'))
+            view.remove_suffix(1);
+          text = text.slice(0, view.size());
+        }
+
+        ctx->current().set(name, text);
+        cursor += length;
+        ++converted;
+        continue;
+      }
+
+      const size_t width = fieldWidth(field.type);
+      if (width == 0)
+        return ctx->reportError(std::string("Bad field specifier '") + field.type + "'");
+
+      if (!field.hasCount)
+      {
+        if (width > left)
+          break;
+
+        ctx->current().set(name, decodeNumber(field, bytes + cursor));
+        cursor += width;
+        ++converted;
+        continue;
+      }
+
+      size_t count = field.all ? left / width : field.count;
+      if (count > left / width)
+        break;
+
+      std::vector<Value> elements;
+      elements.reserve(count);
+      for (size_t i = 0; i < count; ++i, cursor += width)
+        elements.push_back(decodeNumber(field, bytes + cursor));
+
+      ctx->current().set(name, Value::fromList(std::move(elements)));
+      ++converted;
+    }
+
+    ctx->current().result.setInt(converted);
+    return RET_OK;
+  }
+
+}
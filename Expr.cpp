@@ -12,6 +12,10 @@
 
 namespace tcl {
 
+  extern bool flushTailCall(Context * ctx);
+  extern NumberArrayPtr vectorApply(Context * ctx, double (*eval)(double a, double b), NumberArrayPtr const& a, NumberArrayPtr const& b);
+  extern NumberArrayPtr vectorSelect(Context * ctx, NumberArrayPtr const& condition, NumberArrayPtr const& a, NumberArrayPtr const& b);
+
   double evalMinus(double a, double b)
   {
     return -a;
@@ -96,10 +100,15 @@ namespace tcl {
     {"!=", 2,  6,  ASSOC_LEFT, false, evalNotEqual},
     {"&&", 2,  2,  ASSOC_LEFT, false, evalLogicAnd},
     {"||", 2,  1,  ASSOC_LEFT, false, evalLogicOr},
+    {"?",  1,  0, ASSOC_RIGHT, false, NULL},
+    {":",  1,  0, ASSOC_RIGHT, false, NULL},
     {"(",  1,  0,  ASSOC_NONE, false, NULL},
     {")",  1,  0,  ASSOC_NONE, false, NULL}
   };
 
+  // What a '?' on the operand stack turns into once its ':' has been seen
+  static Operand _ternary = {"?:", 2, 0, ASSOC_RIGHT, false, NULL};
+
   inline Operand * getOperand(const char * op)
   {
     static const int len = sizeof(_operands) / sizeof(Operand);
@@ -113,10 +122,106 @@ namespace tcl {
     return 0;
   }
 
-  static bool applyOperand(Context * ctx, Operand * op, std::stack<double> & values, std::stack<Operand *> & operands)
+  // -- Compiled expressions --
+
+  enum NodeType
   {
-    double a, b;
+    NODE_NUMBER,
+    NODE_VARIABLE,
+    NODE_COMMAND,
+    NODE_OPERATOR
+  };
+
+  struct ExprNode
+  {
+    ExprNode(NodeType type)
+      : type(type),
+        number(0.0),
+        op(0)
+    {
+      args[0] = args[1] = args[2] = -1;
+    }
+
+    NodeType type;
+    double number;
+    Operand * op;
+    std::string name;
+    CompiledScriptPtr script;
+    int args[3];
+  };
+
+  // Operands are kept as a tree so '&&', '||' and '?:' only evaluate the side they need
+  struct CompiledExpr
+  {
+    CompiledExpr()
+      : root(-1)
+    { }
+
+    std::vector<ExprNode> nodes;
+    int root;
+  };
+
+  inline bool isOpenTernary(Operand * op)
+  {
+    return op->op[0] == '?' && op != &_ternary;
+  }
+
+  static int addNode(CompiledExpr & expr, ExprNode const& node)
+  {
+    expr.nodes.push_back(node);
+    return (int)expr.nodes.size() - 1;
+  }
+
+  static bool reduce(Context * ctx, CompiledExpr & expr, Operand * op, std::stack<int> & values)
+  {
+    if (isOpenTernary(op))
+    {
+      ctx->reportError("Missing ':' after '?'");
+      return false;
+    }
+
+    const size_t count = op == &_ternary ? 3 : (op->unary ? 1 : 2);
+    if (values.size() < count)
+    {
+      ctx->reportError("Missing operand for operator (" + std::string(op->op) + ")");
+      return false;
+    }
 
+    ExprNode node(NODE_OPERATOR);
+    node.op = op;
+
+    for (size_t i = count; i-- > 0; )
+    {
+      node.args[i] = values.top();
+      values.pop();
+    }
+
+    // Operators on constants are folded, a constant condition leaves only the branch it picks
+    ExprNode const& first = expr.nodes[node.args[0]];
+    if (first.type == NODE_NUMBER)
+    {
+      if (op == &_ternary)
+      {
+        values.push(node.args[first.number > 0.0 ? 1 : 2]);
+        return true;
+      }
+
+      ExprNode const* second = op->unary ? &first : &expr.nodes[node.args[1]];
+      if (second->type == NODE_NUMBER)
+      {
+        ExprNode folded(NODE_NUMBER);
+        folded.number = op->eval(first.number, second->number);
+        values.push(addNode(expr, folded));
+        return true;
+      }
+    }
+
+    values.push(addNode(expr, node));
+    return true;
+  }
+
+  static bool applyOperand(Context * ctx, CompiledExpr & expr, Operand * op, std::stack<int> & values, std::stack<Operand *> & operands)
+  {
     if (op->op[0] == '(')
     {
       operands.push(op);
@@ -128,189 +233,414 @@ namespace tcl {
       {
         Operand * top = operands.top();
         operands.pop();
-        b = values.top();
-        values.pop();
-
-        if (top->unary)
-        {
-          values.push(top->eval(b, 0.0));
-        }
-        else
-        {
-          a = values.top();
-          values.pop();
 
-          values.push(top->eval(a, b));
-        }
+        if (!reduce(ctx, expr, top, values))
+          return false;
       }
 
-      Operand * top = operands.empty() ? 0 : operands.top();
-      operands.pop();
-
-      if (!top || top->op[0] != '(')
+      if (operands.empty())
       {
         ctx->reportError("Stack error, no matching \'(\'");
         return false;
       }
 
+      operands.pop();
       return true;
     }
-
-    if (op->assoc == ASSOC_RIGHT)
+    else if (op->op[0] == ':')
     {
-      while (!operands.empty() && op->precedence < operands.top()->precedence)
+      while (!operands.empty() && operands.top()->op[0] != '(' && !isOpenTernary(operands.top()))
       {
         Operand * top = operands.top();
         operands.pop();
 
-        b = values.top();
-        values.pop();
-
-        if (top->unary)
-        {
-          values.push(top->eval(b, 0.0));
-        }
-        else
-        {
-          a = values.top();
-          values.pop();
+        if (!reduce(ctx, expr, top, values))
+          return false;
+      }
 
-          values.push(top->eval(a, b));
-        }
+      if (operands.empty() || !isOpenTernary(operands.top()))
+      {
+        ctx->reportError("Stack error, no matching \'?\'");
+        return false;
       }
+
+      operands.pop();
+      operands.push(&_ternary);
+      return true;
     }
-    else
-    {
-      while (!operands.empty() && op->precedence <= operands.top()->precedence)
-      {
-        Operand * top = operands.top();
-        operands.pop();
 
-        b = values.top();
-        values.pop();
+    while (!operands.empty())
+    {
+      Operand * top = operands.top();
 
-        if (top->unary)
-        {
-          values.push(top->eval(b, 0.0));
-        }
-        else
-        {
-          a = values.top();
-          values.pop();
+      if (op->assoc == ASSOC_RIGHT ? op->precedence >= top->precedence : op->precedence > top->precedence)
+        break;
 
-          values.push(top->eval(a, b));
-        }
-      }
+      operands.pop();
+      if (!reduce(ctx, expr, top, values))
+        return false;
     }
 
     operands.push(op);
     return true;
   }
 
-  double calculateExpr(Context * ctx, std::string const& str)
+  static bool compileExpr(Context * ctx, std::string const& str, CompiledExpr & expr)
   {
-    //char * str = strdup(_str.c_str());
-    std::stack<double> values;
+    std::stack<int> values;
     std::stack<Operand *> operands;
 
-    Operand startOp = {"X", 0, ASSOC_NONE, 0, NULL};
-    Operand * lastOp = &startOp;
-    const char * digit = NULL;
+    // True when the next token has to be a number, a command or an unary operator
+    bool expectOperand = true;
 
-    for (const char * it = str.c_str(); *it; ++it)
+    // Bounded by the length, a NUL in the text is a syntax error rather than its end
+    const char * stop = str.c_str() + str.size();
+    for (const char * it = str.c_str(); it < stop; ++it)
     {
-      if (!digit)
+      if (isspace(*it))
+        continue;
+
+      if (isdigit(*it) || (*it == '.' && isdigit(it[1])))
       {
-        if (isdigit(*it))
+        if (!expectOperand)
         {
-          digit = it;
+          ctx->reportError("Syntax error in expr '" + str + "'");
+          return false;
         }
-        else if (Operand * op = getOperand(it))
-        {
-          if (lastOp && (lastOp == &startOp || lastOp->op[0] == ')'))
-          {
-            if (op->op[0] == '-')
-            {
-              op = getOperand("~");
-            }
-            else if (op->op[0] != '(')
-            {
-              ctx->reportError("Illegal use of operator (" + std::string(op->op) + ")");
-              return 0.0;
-            }
-          }
 
-          it += op->len - 1;
+        ExprNode node(NODE_NUMBER);
+        node.number = std::atof(it);
 
-          if (!applyOperand(ctx, op, values, operands))
-            return 0.0;
+        while (isdigit(it[1]) || it[1] == '.')
+          ++it;
 
-          lastOp = op;
-        }
-        else if (!isspace(*it))
+        values.push(addNode(expr, node));
+        expectOperand = false;
+      }
+      else if (*it == '$' && isalnum(it[1]))
+      {
+        if (!expectOperand)
         {
           ctx->reportError("Syntax error in expr '" + str + "'");
-          return 0.0;
+          return false;
         }
+
+        // Resolved against the current frame every time the expression runs
+        ExprNode node(NODE_VARIABLE);
+        const char * start = ++it;
+
+        while (isalnum(it[1]))
+          ++it;
+
+        node.name.assign(start, it + 1);
+        values.push(addNode(expr, node));
+        expectOperand = false;
       }
-      else
+      else if (*it == '[')
       {
-        if (isspace(*it))
+        if (!expectOperand)
         {
-          values.push(std::atof(digit));
-          digit = NULL;
-          lastOp = NULL;
+          ctx->reportError("Syntax error in expr '" + str + "'");
+          return false;
         }
-        else if (Operand * op = getOperand(it))
-        {
-          values.push(std::atof(digit));
 
-          it += op->len - 1;
-          digit = NULL;
+        const char * start = it + 1;
+        int level = 1;
+        int braces = 0;
 
-          if (!applyOperand(ctx, op, values, operands))
-            return 0.0;
+        for (++it; *it; ++it)
+        {
+          if (*it == '\\' && it[1])
+            ++it;
+          else if (*it == '{')
+            ++braces;
+          else if (*it == '}' && braces > 0)
+            --braces;
+          else if (braces == 0 && *it == '[')
+            ++level;
+          else if (braces == 0 && *it == ']' && --level == 0)
+            break;
+        }
+
+        if (!*it)
+        {
+          ctx->reportError("Missing ']' in expr '" + str + "'");
+          return false;
+        }
 
-          lastOp = op;
+        // Compiled now, but only executed if evaluation reaches it
+        ExprNode node(NODE_COMMAND);
+        node.script = ctx->compile(std::string(start, it));
+        values.push(addNode(expr, node));
+        expectOperand = false;
+      }
+      else if (Operand * op = getOperand(it))
+      {
+        if (expectOperand)
+        {
+          if (op->op[0] == '-')
+          {
+            op = getOperand("~");
+          }
+          else if (op->op[0] != '(' && !op->unary)
+          {
+            ctx->reportError("Illegal use of operator (" + std::string(op->op) + ")");
+            return false;
+          }
         }
-        else if (!isdigit(*it) && *it != '.')
+        else if (op->op[0] == '(' || op->unary)
         {
           ctx->reportError("Syntax error in expr '" + str + "'");
-          return 0.0;
+          return false;
         }
+
+        it += op->len - 1;
+
+        if (!applyOperand(ctx, expr, op, values, operands))
+          return false;
+
+        expectOperand = op->op[0] != ')';
+      }
+      else
+      {
+        ctx->reportError("Syntax error in expr '" + str + "'");
+        return false;
       }
     }
 
-    if (digit)
-      values.push(std::atof(digit));
-
     while (!operands.empty())
     {
       Operand * op = operands.top();
       operands.pop();
 
-      double b = values.top();
-      values.pop();
+      if (op->op[0] == '(')
+      {
+        ctx->reportError("Stack error, no matching \')\'");
+        return false;
+      }
+
+      if (!reduce(ctx, expr, op, values))
+        return false;
+    }
+
+    if (values.size() != 1)
+    {
+      ctx->reportError("Error while executing expr '" + str + "'");
+      return false;
+    }
+
+    expr.root = values.top();
+    return true;
+  }
+
+  static bool evalNode(Context * ctx, CompiledExpr const& expr, int index, double & out)
+  {
+    ExprNode const& node = expr.nodes[index];
+
+    if (node.type == NODE_NUMBER)
+    {
+      out = node.number;
+      return true;
+    }
+    else if (node.type == NODE_VARIABLE)
+    {
+      Value const* value = ctx->current().get(node.name);
+      if (!value)
+      {
+        ctx->reportError("Could not locate variable '" + node.name + "'");
+        return false;
+      }
+
+      if (!value->asDouble(out))
+      {
+        ctx->reportError("Expected number but got '" + value->str() + "'");
+        return false;
+      }
+
+      return true;
+    }
+    else if (node.type == NODE_COMMAND)
+    {
+      if (failed(ctx->execute(*node.script)) || !flushTailCall(ctx))
+        return false;
 
-      if (op->unary)
+      if (!ctx->current().result.asDouble(out))
       {
-        values.push(op->eval(b, 0.0));
+        ctx->reportError("Expected number but got '" + ctx->current().result.str() + "'");
+        return false;
       }
+
+      return true;
+    }
+
+    Operand * op = node.op;
+    double a, b;
+
+    if (!evalNode(ctx, expr, node.args[0], a))
+      return false;
+
+    if (op == &_ternary)
+      return evalNode(ctx, expr, a > 0.0 ? node.args[1] : node.args[2], out);
+
+    if (op->unary)
+    {
+      out = op->eval(a, 0.0);
+      return true;
+    }
+
+    // Short-circuit, the right hand side is never evaluated when the left decides
+    if (op->eval == evalLogicAnd && !(a > 0.0))
+    {
+      out = 0.0;
+      return true;
+    }
+    else if (op->eval == evalLogicOr && a > 0.0)
+    {
+      out = 1.0;
+      return true;
+    }
+
+    if (!evalNode(ctx, expr, node.args[1], b))
+      return false;
+
+    out = op->eval(a, b);
+    return true;
+  }
+
+  // -- Vector expressions --
+
+  static NumberArrayPtr expectNumbers(Context * ctx, Value const& value)
+  {
+    NumberArrayPtr numbers = value.asNumbers();
+    if (!numbers)
+      ctx->reportError("Expected list of numbers but got '" + value.str() + "'");
+    return numbers;
+  }
+
+  // The same tree as evalNode over packed lists, '&&', '||' and '?:' evaluate both sides
+  static NumberArrayPtr evalVectorNode(Context * ctx, CompiledExpr const& expr, int index)
+  {
+    ExprNode const& node = expr.nodes[index];
+
+    if (node.type == NODE_NUMBER)
+    {
+      std::shared_ptr<NumberArray> number = std::make_shared<NumberArray>();
+      if (node.number == std::floor(node.number) && std::abs(node.number) < 9007199254740992.0)
+        number->ints.push_back((int64_t)node.number);
       else
       {
-        double a = values.top();
-        values.pop();
-        values.push(op->eval(a, b));
+        number->isInt = false;
+        number->doubles.push_back(node.number);
       }
+      return number;
     }
+    else if (node.type == NODE_VARIABLE)
+    {
+      Value const* value = ctx->current().get(node.name);
+      if (!value)
+      {
+        ctx->reportError("Could not locate variable '" + node.name + "'");
+        return NumberArrayPtr();
+      }
 
-    if (values.size() != 1)
+      return expectNumbers(ctx, *value);
+    }
+    else if (node.type == NODE_COMMAND)
     {
-      ctx->reportError("Error while executing expr '" + str + "'");
-      return 0.0;
+      if (failed(ctx->execute(*node.script)) || !flushTailCall(ctx))
+        return NumberArrayPtr();
+
+      return expectNumbers(ctx, ctx->current().result);
+    }
+
+    NumberArrayPtr a = evalVectorNode(ctx, expr, node.args[0]);
+    if (!a)
+      return NumberArrayPtr();
+
+    if (node.op->unary)
+      return vectorApply(ctx, node.op->eval, a, a);
+
+    NumberArrayPtr b = evalVectorNode(ctx, expr, node.args[1]);
+    if (!b)
+      return NumberArrayPtr();
+
+    if (node.op == &_ternary)
+    {
+      NumberArrayPtr c = evalVectorNode(ctx, expr, node.args[2]);
+      return c ? vectorSelect(ctx, a, b, c) : NumberArrayPtr();
     }
 
-    return values.top();
+    return vectorApply(ctx, node.op->eval, a, b);
+  }
+
+  // Bounded by bytes like the script cache, large expressions are not cached
+  static const size_t MaxCachedExprBytes = 2 << 20;
+  static const size_t MaxCachedExprSlice = 16;
+
+  static size_t compiledSize(CompiledExpr const& expr)
+  {
+    size_t total = sizeof(CompiledExpr) + expr.nodes.size() * sizeof(ExprNode);
+    for (size_t i = 0; i < expr.nodes.size(); ++i)
+      total += expr.nodes[i].name.size();
+    return total;
+  }
+
+  CompiledExprPtr compileExpression(Context * ctx, std::string const& str)
+  {
+    ExprCache::iterator it = ctx->exprs.find(str);
+    if (it != ctx->exprs.end())
+      return it->second;
+
+    CompiledExprPtr expr = std::make_shared<CompiledExpr>();
+    if (!compileExpr(ctx, str, *expr))
+      return CompiledExprPtr();
+
+    const size_t budget = ctx->cacheBudget(MaxCachedExprBytes);
+    const size_t size = str.size() + compiledSize(*expr);
+    if (size > budget / MaxCachedExprSlice)
+      return expr;
+
+    if (ctx->exprBytes + size > budget)
+    {
+      ctx->exprs.clear();
+      ctx->exprBytes = 0;
+    }
+
+    if (ctx->exprs.insert(std::make_pair(str, expr)).second)
+      ctx->exprBytes += size;
+    return expr;
+  }
+
+  bool evaluateExpression(Context * ctx, CompiledExpr const& expr, double & result)
+  {
+    return evalNode(ctx, expr, expr.root, result);
+  }
+
+  bool constantExpression(CompiledExpr const& expr, double & value)
+  {
+    ExprNode const& root = expr.nodes[expr.root];
+    if (root.type != NODE_NUMBER)
+      return false;
+
+    value = root.number;
+    return true;
+  }
+
+  bool evaluateVectorExpression(Context * ctx, CompiledExpr const& expr, NumberArrayPtr & result)
+  {
+    result = evalVectorNode(ctx, expr, expr.root);
+    return result != 0;
+  }
+
+  double calculateExpr(Context * ctx, std::string const& str)
+  {
+    CompiledExprPtr expr = compileExpression(ctx, str);
+    double result = 0.0;
+
+    if (!expr || !evaluateExpression(ctx, *expr, result))
+      return 0.0;
+
+    return result;
   }
 
 }
@@ -20,6 +20,7 @@ int main(int argc, char * argv[])
   ctx.registerProc("exit", exitProc);
 
   std::string completeLine = "";
+  int braceCount = 0;
 
   if (argc > 1)
     for (int i = 1; i < argc; ++i)
@@ -38,32 +39,15 @@ int main(int argc, char * argv[])
     std::cin.getline(line, 1024);
 
     completeLine += std::string(line);
-    int braceCount = 0;
-    for (int i = 0; i < completeLine.size(); ++i)
-    {
-      switch (completeLine[i])
-      {
-        case '{':
-          braceCount++;
-          break;
-        case '[':
-          braceCount++;
-          break;
-        case '}':
-          braceCount--;
-          break;
-        case ']':
-          braceCount--;
-          break;
-      }
-    }
+    braceCount += tcl::bracketBalance(line);
 
     if (braceCount == 0)
     {
-      if (ctx.evaluate(completeLine) == tcl::RET_ERROR)
+      tcl::ReturnCode retCode = ctx.evaluate(completeLine);
+      if (retCode == tcl::RET_ERROR || retCode == tcl::RET_LIMIT)
         std::cout << "Error: " << ctx.error << std::endl;
       else if (!ctx.current().result.empty())
-        std::cout << ctx.current().result << std::endl;
+        std::cout << ctx.current().result.str() << std::endl;
       completeLine = "";
     }
     else
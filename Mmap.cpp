@@ -0,0 +1,210 @@
+#include "TinyTcl.h"
+
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#if defined(_WIN32)
+#define TCL_MMAP_WIN32
+#endif
+
+#ifdef TCL_MMAP_WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace tcl {
+
+  // -- Platform --
+
+  // Files are identified by device, file index, size and modification time, so a file that
+  // was replaced gets a fresh mapping while interpreters mapping the same file share one.
+  typedef std::tuple<uint64_t, uint64_t, uint64_t, uint64_t> MappedFileKey;
+
+#ifdef TCL_MMAP_WIN32
+
+  typedef HANDLE FileHandle;
+
+  static FileHandle openFile(std::string const& path)
+  {
+    return CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  }
+
+  static bool validFile(FileHandle file)
+  {
+    return file != INVALID_HANDLE_VALUE;
+  }
+
+  static void closeFile(FileHandle file)
+  {
+    CloseHandle(file);
+  }
+
+  static bool identifyFile(FileHandle file, MappedFileKey & key, size_t & size)
+  {
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(file, &info) || (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+      return false;
+
+    const uint64_t length = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    if (length > SIZE_MAX)
+      return false;
+
+    size = (size_t)length;
+    key = MappedFileKey(info.dwVolumeSerialNumber,
+                        ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow,
+                        length,
+                        ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime);
+    return true;
+  }
+
+  static void * mapView(FileHandle file, size_t size)
+  {
+    HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    if (!mapping)
+      return 0;
+
+    // The view keeps the mapping object alive
+    void * data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+    CloseHandle(mapping);
+    return data;
+  }
+
+  static void unmapView(void * data, size_t size)
+  {
+    UnmapViewOfFile(data);
+  }
+
+#else
+
+  typedef int FileHandle;
+
+  static FileHandle openFile(std::string const& path)
+  {
+    return open(path.c_str(), O_RDONLY);
+  }
+
+  static bool validFile(FileHandle file)
+  {
+    return file >= 0;
+  }
+
+  static void closeFile(FileHandle file)
+  {
+    close(file);
+  }
+
+  static bool identifyFile(FileHandle file, MappedFileKey & key, size_t & size)
+  {
+    struct stat info;
+    if (fstat(file, &info) != 0 || !S_ISREG(info.st_mode))
+      return false;
+
+    size = (size_t)info.st_size;
+    key = MappedFileKey(info.st_dev, info.st_ino, info.st_size, info.st_mtime);
+    return true;
+  }
+
+  static void * mapView(FileHandle file, size_t size)
+  {
+    void * data = mmap(0, size, PROT_READ, MAP_PRIVATE, file, 0);
+    return data == MAP_FAILED ? 0 : data;
+  }
+
+  static void unmapView(void * data, size_t size)
+  {
+    munmap(data, size);
+  }
+
+#endif
+
+  // -- Mapped files --
+
+  // A read-only mapping, unmapped when the last value slicing into it goes away
+  struct MappedFile
+  {
+    MappedFile(void * data, size_t size)
+      : data(data),
+        size(size)
+    { }
+
+    ~MappedFile()
+    {
+      unmapView(data, size);
+    }
+
+    void * data;
+    size_t size;
+  };
+
+  typedef std::map<MappedFileKey, std::weak_ptr<MappedFile> > MappedFileMap;
+
+  static std::mutex mappedFilesLock;
+  static MappedFileMap mappedFiles;
+
+  bool mapFile(Context * ctx, std::string const& path, Value & result)
+  {
+    FileHandle fd = openFile(path);
+    if (!validFile(fd))
+    {
+      ctx->reportError("Could not open file '" + path + "'");
+      return false;
+    }
+
+    MappedFileKey key;
+    size_t size;
+    if (!identifyFile(fd, key, size))
+    {
+      closeFile(fd);
+      ctx->reportError("Could not map file '" + path + "'");
+      return false;
+    }
+
+    if (size == 0)
+    {
+      closeFile(fd);
+      result = Value();
+      return true;
+    }
+
+    std::shared_ptr<MappedFile> file;
+
+    std::lock_guard<std::mutex> lock(mappedFilesLock);
+
+    MappedFileMap::iterator it = mappedFiles.find(key);
+    if (it != mappedFiles.end())
+      file = it->second.lock();
+
+    if (!file)
+    {
+      void * data = mapView(fd, size);
+      if (!data)
+      {
+        closeFile(fd);
+        ctx->reportError("Could not map file '" + path + "'");
+        return false;
+      }
+
+      // Drop entries whose mapping is already gone before adding a new one
+      for (it = mappedFiles.begin(); it != mappedFiles.end();)
+      {
+        if (it->second.expired())
+          it = mappedFiles.erase(it);
+        else
+          ++it;
+      }
+
+      file = std::make_shared<MappedFile>(data, size);
+      mappedFiles[key] = file;
+    }
+
+    closeFile(fd);
+    result = Value::fromExternal(file, std::string_view(static_cast<const char *>(file->data), file->size));
+    return true;
+  }
+
+}
@@ -0,0 +1,131 @@
+
+#include "TinyTcl.h"
+
+#include <string.h>
+#include <stdint.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TCL_SCANNER_SSE2
+#endif
+
+namespace tcl {
+
+  // -- Structural scanner --
+
+  // Like the first stage of simdjson, a block of 64 bytes is turned into a bitmask of the
+  // characters the parser has to stop at, {}[]"\$; and newline. Everything else is copied in bulk.
+
+#ifdef TCL_SCANNER_SSE2
+
+  static inline uint64_t structuralBits16(const char * data)
+  {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+
+    __m128i hits = _mm_cmpeq_epi8(chunk, _mm_set1_epi8('{'));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('}')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('[')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(']')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('$')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(';')));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+
+    return (uint32_t)_mm_movemask_epi8(hits);
+  }
+
+  static inline uint64_t structuralBits64(const char * data)
+  {
+    return structuralBits16(data) |
+           structuralBits16(data + 16) << 16 |
+           structuralBits16(data + 32) << 32 |
+           structuralBits16(data + 48) << 48;
+  }
+
+#else
+
+  static inline bool isStructural(char c)
+  {
+    return c == '{' || c == '}' || c == '[' || c == ']' || c == '"' || c == '\\' || c == '$' || c == ';' || c == '\n';
+  }
+
+  static inline uint64_t structuralBits64(const char * data)
+  {
+    uint64_t bits = 0;
+    for (int i = 0; i < 64; ++i)
+      if (isStructural(data[i]))
+        bits |= (uint64_t)1 << i;
+    return bits;
+  }
+
+#endif
+
+  static inline unsigned lowestBit(uint64_t bits)
+  {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctzll(bits);
+#endif
+  }
+
+  // Bitmask of the structural characters in the block of code starting at offset
+  static uint64_t structuralBits(std::string_view code, size_t offset)
+  {
+    if (code.size() - offset >= 64)
+      return structuralBits64(code.data() + offset);
+
+    // The tail of the code is padded with zeros, which are never structural
+    char block[64];
+    memcpy(block, code.data() + offset, code.size() - offset);
+    memset(block + code.size() - offset, 0, 64 - (code.size() - offset));
+    return structuralBits64(block);
+  }
+
+  // Position of the next structural character at or after from, or the end of the code.
+  // The mask of the last block looked at is kept in block/bits for the next call.
+  size_t nextStructural(std::string_view code, size_t from, size_t & block, uint64_t & bits)
+  {
+    while (from < code.size())
+    {
+      const size_t start = from & ~(size_t)63;
+      if (start != block)
+      {
+        block = start;
+        bits = structuralBits(code, start);
+      }
+
+      const uint64_t ahead = bits >> (from - start);
+      if (ahead)
+        return from + lowestBit(ahead);
+
+      from = start + 64;
+    }
+
+    return code.size();
+  }
+
+  int bracketBalance(std::string_view code)
+  {
+    int balance = 0;
+    size_t block = SIZE_MAX;
+    uint64_t bits = 0;
+
+    for (size_t pos = nextStructural(code, 0, block, bits); pos < code.size(); pos = nextStructural(code, pos + 1, block, bits))
+    {
+      if (code[pos] == '{' || code[pos] == '[')
+        ++balance;
+      else if (code[pos] == '}' || code[pos] == ']')
+        --balance;
+    }
+
+    return balance;
+  }
+
+}
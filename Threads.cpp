@@ -0,0 +1,730 @@
+
+#include "TinyTcl.h"
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+
+namespace tcl {
+
+  // -- Bounded queue --
+
+  // Dmitry Vyukov's bounded queue: every cell carries a sequence number telling producers and
+  // the consumer whose turn it is, so neither side ever takes a lock.
+  template <typename T>
+  struct BoundedQueue
+  {
+    struct Cell
+    {
+      std::atomic<size_t> sequence;
+      T data;
+    };
+
+    BoundedQueue(size_t capacity)
+      : cells(capacity),
+        mask(capacity - 1),
+        enqueuePos(0),
+        dequeuePos(0)
+    {
+      for (size_t i = 0; i < capacity; ++i)
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Any thread may push, fails when the queue is full
+    bool push(T && data)
+    {
+      size_t pos = enqueuePos.load(std::memory_order_relaxed);
+      Cell * cell;
+
+      while (true)
+      {
+        cell = &cells[pos & mask];
+        intptr_t diff = (intptr_t)cell->sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+          if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        }
+        else if (diff < 0)
+          return false;
+        else
+          pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+
+      cell->data = std::move(data);
+      cell->sequence.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Only the owning thread pops
+    bool pop(T & data)
+    {
+      size_t pos = dequeuePos.load(std::memory_order_relaxed);
+      Cell * cell = &cells[pos & mask];
+
+      if ((intptr_t)cell->sequence.load(std::memory_order_acquire) - (intptr_t)(pos + 1) < 0)
+        return false;
+
+      data = std::move(cell->data);
+      cell->data = T();
+      cell->sequence.store(pos + mask + 1, std::memory_order_release);
+      dequeuePos.store(pos + 1, std::memory_order_relaxed);
+      return true;
+    }
+
+    bool full() const
+    {
+      size_t pos = enqueuePos.load(std::memory_order_relaxed);
+      return (intptr_t)cells[pos & mask].sequence.load(std::memory_order_acquire) - (intptr_t)pos < 0;
+    }
+
+    bool empty() const
+    {
+      size_t pos = dequeuePos.load(std::memory_order_relaxed);
+      return (intptr_t)cells[pos & mask].sequence.load(std::memory_order_acquire) - (intptr_t)(pos + 1) < 0;
+    }
+
+    std::vector<Cell> cells;
+    const size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos;
+    alignas(64) std::atomic<size_t> dequeuePos;
+  };
+
+  // -- Threads --
+
+  static const size_t MailboxSize = 1024;
+  static const std::chrono::seconds MailboxTimeout(10);
+
+  enum MessageType
+  {
+    MSG_EVAL,
+    MSG_VALUE
+  };
+
+  struct ThreadState;
+
+  // Values are detached before they are queued, the receiving thread gets a representation of its own
+  struct ThreadMessage
+  {
+    ThreadMessage()
+      : type(MSG_VALUE)
+    { }
+
+    void answer(ThreadResult const& result);
+
+    MessageType type;
+    Value value;
+    std::shared_ptr<std::promise<ThreadResult> > reply;
+    std::weak_ptr<ThreadState> sender;
+  };
+
+  static ThreadResult exitingResult(std::string const& id)
+  {
+    ThreadResult result;
+    result.code = RET_ERROR;
+    result.error = "Thread '" + id + "' is exiting";
+    return result;
+  }
+
+  static bool isReady(std::future<ThreadResult> const& reply)
+  {
+    return reply.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  }
+
+  struct ThreadState : std::enable_shared_from_this<ThreadState>
+  {
+    ThreadState(std::string const& id, std::thread::id owner)
+      : id(id),
+        owner(owner),
+        queue(MailboxSize),
+        sleeping(false),
+        blockedSenders(0),
+        closed(false)
+    { }
+
+    // Workers are joined by releaseThread or at exit, only a thread dropping its own state lands here
+    ~ThreadState()
+    {
+      close();
+      if (thread.joinable())
+      {
+        if (thread.get_id() == std::this_thread::get_id())
+          thread.detach();
+        else
+          thread.join();
+      }
+      drain();
+    }
+
+    // A full mailbox makes the sender wait for room, that is the back pressure of a bounded queue.
+    // Only the owner empties a mailbox, so posting to its own full one fails right away.
+    bool post(ThreadMessage && message, bool own)
+    {
+      if (closed.load())
+        return false;
+
+      if (!queue.push(std::move(message)))
+      {
+        if (own)
+          return false;
+
+        const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + MailboxTimeout;
+        std::unique_lock<std::mutex> lock(sleepLock);
+        ++blockedSenders;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        bool pushed = queue.push(std::move(message));
+        while (!pushed && !closed.load() && room.wait_until(lock, deadline) != std::cv_status::timeout)
+          pushed = queue.push(std::move(message));
+
+        --blockedSenders;
+        if (!pushed && (closed.load() || !queue.push(std::move(message))))
+          return false;
+      }
+
+      // Pairs with the fence in wait, either the sleeper sees the message or this sees the sleeper
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleeping.load())
+        wake();
+      return true;
+    }
+
+    // Waits for the next message, the lock is only taken to sleep on an empty mailbox.
+    // A pending reply or a closed mailbox also ends the wait.
+    bool wait(ThreadMessage & message, std::chrono::milliseconds timeout, std::future<ThreadResult> const* reply = 0)
+    {
+      if (pop(message))
+        return true;
+
+      std::unique_lock<std::mutex> lock(sleepLock);
+      sleeping.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      wakeup.wait_for(lock, timeout, [this, reply] { return !queue.empty() || closed.load() || (reply && isReady(*reply)); });
+      sleeping.store(false);
+      lock.unlock();
+
+      return pop(message);
+    }
+
+    bool pop(ThreadMessage & message)
+    {
+      if (!queue.pop(message))
+        return false;
+
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (blockedSenders.load())
+      {
+        std::lock_guard<std::mutex> lock(sleepLock);
+        room.notify_all();
+      }
+      return true;
+    }
+
+    void wake()
+    {
+      std::lock_guard<std::mutex> lock(sleepLock);
+      wakeup.notify_all();
+    }
+
+    // Refuses new messages and wakes everybody sleeping on this mailbox
+    void close()
+    {
+      closed.store(true);
+      std::lock_guard<std::mutex> lock(sleepLock);
+      wakeup.notify_all();
+      room.notify_all();
+    }
+
+    // Fails what is left in a closed mailbox, only called by the thread popping it
+    void drain()
+    {
+      ThreadMessage message;
+      while (pop(message))
+        if (message.reply)
+          message.answer(exitingResult(id));
+    }
+
+    std::string id;
+    std::thread::id owner;
+    BoundedQueue<ThreadMessage> queue;
+    std::atomic<bool> sleeping;
+    std::mutex sleepLock;
+    std::condition_variable wakeup;
+    std::atomic<int> blockedSenders;
+    std::condition_variable room;
+    std::atomic<bool> closed;
+    std::thread thread;
+
+    // Only touched by the thread itself
+    std::deque<Value> received;
+  };
+
+  void ThreadMessage::answer(ThreadResult const& result)
+  {
+    reply->set_value(result);
+    if (std::shared_ptr<ThreadState> state = sender.lock())
+      state->wake();
+  }
+
+  typedef std::map<std::string, std::shared_ptr<ThreadState> > ThreadMap;
+
+  // At exit every mailbox is closed before anything is joined: a worker blocked sending to the
+  // exiting thread gets an error reply instead of keeping the process alive.
+  struct ThreadRegistry
+  {
+    ~ThreadRegistry()
+    {
+      ThreadMap all;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        all.swap(threads);
+      }
+
+      ThreadMap::iterator it;
+      for (it = all.begin(); it != all.end(); ++it)
+        it->second->close();
+
+      for (it = all.begin(); it != all.end(); ++it)
+        if (it->second->owner == std::this_thread::get_id())
+          it->second->drain();
+
+      for (it = all.begin(); it != all.end(); ++it)
+        if (it->second->thread.joinable())
+          it->second->thread.join();
+    }
+
+    std::mutex lock;
+    ThreadMap threads;
+  };
+
+  static ThreadRegistry registry;
+  static std::atomic<unsigned> threadCounter(0);
+
+  static thread_local ThreadState * self = 0;
+  static thread_local std::map<std::string, std::future<ThreadResult> > pendingReplies;
+
+  static const std::chrono::milliseconds Forever(std::chrono::hours(24 * 365));
+
+  static std::shared_ptr<ThreadState> findThread(std::string const& id)
+  {
+    std::lock_guard<std::mutex> lock(registry.lock);
+    ThreadMap::iterator it = registry.threads.find(id);
+    return it == registry.threads.end() ? std::shared_ptr<ThreadState>() : it->second;
+  }
+
+  // Threads that did not come from createThread get a mailbox the first time they need one, it is
+  // closed and unregistered when the thread ends
+  struct HostThread
+  {
+    ~HostThread()
+    {
+      if (!state)
+        return;
+
+      {
+        std::lock_guard<std::mutex> lock(registry.lock);
+        ThreadMap::iterator it = registry.threads.find(state->id);
+        if (it != registry.threads.end() && it->second == state)
+          registry.threads.erase(it);
+      }
+
+      state->close();
+      state->drain();
+      self = 0;
+    }
+
+    std::shared_ptr<ThreadState> state;
+  };
+
+  static thread_local HostThread hostThread;
+
+  static ThreadState * currentThread()
+  {
+    if (!self)
+    {
+      std::shared_ptr<ThreadState> state = std::make_shared<ThreadState>("tid" + std::to_string(threadCounter++), std::this_thread::get_id());
+      {
+        std::lock_guard<std::mutex> lock(registry.lock);
+        registry.threads[state->id] = state;
+      }
+      hostThread.state = state;
+      self = state.get();
+    }
+    return self;
+  }
+
+  // Messages may arrive while a procedure waits in thread::receive or for a reply, they still run at
+  // global level. The waiting frames are set aside with a swap, which keeps references to them valid.
+  static ThreadResult evaluateMessage(Context * ctx, std::string const& script)
+  {
+    Value waitingResult = ctx->current().result;
+    CallFrameStack waiting;
+    waiting.swap(ctx->frames);
+
+    ctx->frames.push_back(CallFrame());
+    CallFrame & globals = ctx->frames.front();
+    globals.variables.swap(waiting.front().variables);
+    globals.inherited.swap(waiting.front().inherited);
+    globals.result = waiting.front().result;
+
+    ThreadResult result;
+    result.code = ctx->evaluate(script);
+    if (failed(result.code))
+      result.error = ctx->error;
+    else
+      result.result = ctx->current().result.detach();
+
+    waiting.front().variables.swap(globals.variables);
+    waiting.front().inherited.swap(globals.inherited);
+    ctx->frames.swap(waiting);
+    ctx->current().result = waitingResult;
+    return result;
+  }
+
+  static void handleMessage(Context * ctx, ThreadState * state, ThreadMessage & message)
+  {
+    if (message.type == MSG_EVAL)
+    {
+      ThreadResult result = evaluateMessage(ctx, message.value.str());
+      if (message.reply)
+        message.answer(result);
+    }
+    else
+      state->received.push_back(message.value);
+  }
+
+  // Workers count commands in rounds, a script still running when the mailbox is closed ends with
+  // the round, so releasing a thread or exiting never waits for an endless loop
+  static const uint64_t WorkerRound = 10000;
+
+  static bool workerLimit(Context * ctx, LimitType type, void * data)
+  {
+    ThreadState * state = static_cast<ThreadState *>(data);
+    if (type != LIMIT_COMMANDS || state->closed.load())
+      return false;
+
+    ctx->limits.commands = ctx->commandCount + WorkerRound;
+    return true;
+  }
+
+  // The worker keeps its state alive until it leaves, closing the mailbox is what makes it leave
+  static void threadMain(std::shared_ptr<ThreadState> state, std::string script)
+  {
+    self = state.get();
+
+    {
+      Context ctx;
+      Limits limits;
+      limits.commands = WorkerRound;
+      ctx.setLimits(limits, workerLimit, state.get());
+
+      if (!script.empty())
+        ctx.evaluate(script);
+
+      ThreadMessage message;
+      while (!state->closed.load())
+        if (state->wait(message, Forever))
+          handleMessage(&ctx, state.get(), message);
+    }
+
+    state->drain();
+  }
+
+  // How long a waiting thread may sleep before the time limits of its context need a look
+  static std::chrono::milliseconds limitTimeout(Context * ctx)
+  {
+    std::chrono::steady_clock::time_point until = ctx->limits.deadline;
+    if (ctx->limits.slice.count())
+      until = std::min(until, ctx->nextSlice);
+
+    if (until == std::chrono::steady_clock::time_point::max())
+      return Forever;
+
+    std::chrono::milliseconds left = std::chrono::ceil<std::chrono::milliseconds>(until - std::chrono::steady_clock::now());
+    return std::max(std::chrono::milliseconds(0), std::min(left, Forever));
+  }
+
+  // A thread waiting for a reply keeps serving its own mailbox, two threads sending to each other do not deadlock.
+  // The limits of the waiting context still apply, running out of them fails the wait rather than the remote script.
+  static ReturnCode waitForReply(Context * ctx, std::future<ThreadResult> & reply, ThreadResult & result)
+  {
+    ThreadState * state = currentThread();
+    ThreadMessage message;
+
+    while (!isReady(reply))
+    {
+      if (state->wait(message, limitTimeout(ctx), &reply))
+        handleMessage(ctx, state, message);
+      else if (state->closed.load() && !isReady(reply))
+      {
+        result = exitingResult(state->id);
+        return RET_OK;
+      }
+
+      ReturnCode retCode = ctx->checkLimits();
+      if (retCode != RET_OK)
+        return retCode;
+    }
+
+    try
+    {
+      result = reply.get();
+    }
+    catch (std::future_error const&)
+    {
+      result.code = RET_ERROR;
+      result.error = "Thread exited without replying";
+    }
+    return RET_OK;
+  }
+
+  std::string createThread(std::string const& script)
+  {
+    std::shared_ptr<ThreadState> state = std::make_shared<ThreadState>("tid" + std::to_string(threadCounter++), std::thread::id());
+    std::lock_guard<std::mutex> lock(registry.lock);
+    state->thread = std::thread(threadMain, state, script);
+    registry.threads[state->id] = state;
+    return state->id;
+  }
+
+  static bool deliver(std::string const& id, ThreadMessage && message, std::string & error)
+  {
+    std::shared_ptr<ThreadState> state = findThread(id);
+    if (!state)
+    {
+      error = "Could not find thread '" + id + "'";
+      return false;
+    }
+
+    if (!state->post(std::move(message), state.get() == self))
+    {
+      error = state->closed.load() ? "Thread '" + id + "' is exiting" : "Mailbox of thread '" + id + "' is full";
+      return false;
+    }
+
+    return true;
+  }
+
+  static bool sendMessage(std::string const& id, std::string const& script, std::future<ThreadResult> & reply, std::string & error)
+  {
+    ThreadMessage message;
+    message.type = MSG_EVAL;
+    message.value = Value(script);
+    message.reply = std::make_shared<std::promise<ThreadResult> >();
+    if (self)
+      message.sender = self->shared_from_this();
+    reply = message.reply->get_future();
+
+    return deliver(id, std::move(message), error);
+  }
+
+  static bool postMessage(std::string const& id, Value const& value, std::string & error)
+  {
+    ThreadMessage message;
+    message.value = value.detach();
+    return deliver(id, std::move(message), error);
+  }
+
+  bool sendScript(std::string const& id, std::string const& script, std::future<ThreadResult> & reply)
+  {
+    std::string error;
+    return sendMessage(id, script, reply, error);
+  }
+
+  bool postValue(std::string const& id, Value const& value)
+  {
+    std::string error;
+    return postMessage(id, value, error);
+  }
+
+  bool releaseThread(std::string const& id)
+  {
+    std::shared_ptr<ThreadState> state;
+    {
+      std::lock_guard<std::mutex> lock(registry.lock);
+      ThreadMap::iterator it = registry.threads.find(id);
+      if (it == registry.threads.end() || !it->second->thread.joinable() || it->second.get() == self)
+        return false;
+
+      state = it->second;
+      registry.threads.erase(it);
+    }
+
+    // The worker fails what is left in its mailbox on the way out
+    state->close();
+    state->thread.join();
+    return true;
+  }
+
+  // -- Thread commands --
+
+  ReturnCode builtInThreadCreate(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() > 2)
+      return ctx->arityError(args[0].str());
+
+    ctx->current().result = Value(createThread(args.size() == 2 ? args[1].str() : std::string()));
+    return RET_OK;
+  }
+
+  // thread::send ?-async? id script ?-async?
+  ReturnCode builtInThreadSend(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    std::vector<Value const*> words;
+    bool async = false;
+
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+      if (args[i] == "-async")
+        async = true;
+      else
+        words.push_back(&args[i]);
+    }
+
+    if (words.size() != 2)
+      return ctx->arityError(args[0].str());
+
+    std::string const& id = words[0]->str();
+    std::future<ThreadResult> reply;
+
+    // Sending to itself would wait for a message only this thread can handle
+    if (!async && self && self->id == id)
+    {
+      ReturnCode retCode = ctx->evaluate(words[1]->str());
+      return retCode;
+    }
+
+    // Registered first, so the reply can wake this thread
+    currentThread();
+
+    std::string error;
+    if (!sendMessage(id, words[1]->str(), reply, error))
+      return ctx->reportError(error);
+
+    if (async)
+    {
+      std::string future = "future" + std::to_string(threadCounter++);
+      pendingReplies[future] = std::move(reply);
+      ctx->current().result = Value(future);
+      return RET_OK;
+    }
+
+    ThreadResult result;
+    ReturnCode retCode = waitForReply(ctx, reply, result);
+    if (retCode != RET_OK)
+      return retCode;
+
+    if (failed(result.code))
+      return ctx->reportError(result.error);
+
+    ctx->current().result = result.result;
+    return RET_OK;
+  }
+
+  // thread::wait future, the result of an asynchronous send
+  ReturnCode builtInThreadWait(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2)
+      return ctx->arityError(args[0].str());
+
+    std::map<std::string, std::future<ThreadResult> >::iterator it = pendingReplies.find(args[1].str());
+    if (it == pendingReplies.end())
+      return ctx->reportError("Could not find reply '" + args[1].str() + "'");
+
+    // A wait cut short by a limit leaves the reply pending
+    ThreadResult result;
+    ReturnCode retCode = waitForReply(ctx, it->second, result);
+    if (retCode != RET_OK)
+      return retCode;
+
+    pendingReplies.erase(it);
+
+    if (failed(result.code))
+      return ctx->reportError(result.error);
+
+    ctx->current().result = result.result;
+    return RET_OK;
+  }
+
+  // thread::post id value, queues a value for thread::receive without evaluating anything
+  ReturnCode builtInThreadPost(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    std::string error;
+    if (!postMessage(args[1].str(), args[2], error))
+      return ctx->reportError(error);
+
+    ctx->current().result = Value();
+    return RET_OK;
+  }
+
+  // thread::receive ?timeout?, scripts sent meanwhile are evaluated while waiting
+  ReturnCode builtInThreadReceive(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() > 2)
+      return ctx->arityError(args[0].str());
+
+    int64_t milliseconds = -1;
+    if (args.size() == 2 && !args[1].asInt(milliseconds))
+      return ctx->reportError("Expected a timeout in milliseconds but got '" + args[1].str() + "'");
+
+    ThreadState * state = currentThread();
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+    ThreadMessage message;
+
+    while (state->received.empty() && !state->closed.load())
+    {
+      std::chrono::milliseconds timeout = Forever;
+      if (milliseconds >= 0)
+      {
+        timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (timeout.count() <= 0)
+          return ctx->reportError("Timeout while waiting for a message");
+      }
+
+      if (state->wait(message, std::min(timeout, limitTimeout(ctx))))
+        handleMessage(ctx, state, message);
+
+      ReturnCode retCode = ctx->checkLimits();
+      if (retCode != RET_OK)
+        return retCode;
+    }
+
+    if (state->received.empty())
+      return ctx->reportError("Thread is exiting");
+
+    ctx->current().result = state->received.front();
+    state->received.pop_front();
+    return RET_OK;
+  }
+
+  ReturnCode builtInThreadId(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 1)
+      return ctx->arityError(args[0].str());
+
+    ctx->current().result = Value(currentThread()->id);
+    return RET_OK;
+  }
+
+  ReturnCode builtInThreadRelease(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2)
+      return ctx->arityError(args[0].str());
+
+    if (self && self->id == args[1].str())
+      return ctx->reportError("A thread can not release itself");
+
+    if (!releaseThread(args[1].str()))
+      return ctx->reportError("Could not find thread '" + args[1].str() + "'");
+
+    ctx->current().result = Value();
+    return RET_OK;
+  }
+
+}
@@ -4,11 +4,41 @@
 #include <iostream>
 #include <cstdlib>
 #include <cmath>
+#include <algorithm>
+#include <list>
+#include <atomic>
+#include <ctype.h>
 #include <stdio.h>
+#include <string.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace tcl {
 
   extern double calculateExpr(Context * ctx, std::string const& _str);
+  extern CompiledExprPtr compileExpression(Context * ctx, std::string const& str);
+  extern bool evaluateExpression(Context * ctx, CompiledExpr const& expr, double & result);
+  extern bool flushTailCall(Context * ctx);
+  extern bool mapFile(Context * ctx, std::string const& path, Value & result);
+  extern ReturnCode binaryFormat(Context * ctx, ArgumentVector const& args);
+  extern ReturnCode binaryScan(Context * ctx, ArgumentVector const& args);
+  extern ReturnCode builtInTsvSet(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInTsvGet(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInTsvIncr(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInTsvLappend(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInTsvExists(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInTsvUnset(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInThreadCreate(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInThreadSend(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInThreadWait(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInThreadPost(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInThreadReceive(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInThreadId(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInThreadRelease(Context * ctx, ArgumentVector const& args, void * data);
+  extern ReturnCode builtInVexpr(Context * ctx, ArgumentVector const& args, void * data);
+  extern bool constantExpression(CompiledExpr const& expr, double & value);
+  extern size_t nextStructural(std::string_view code, size_t from, size_t & block, uint64_t & bits);
 
   // -- Utils --
 
@@ -26,6 +56,500 @@ namespace tcl {
     }
   }
 
+  // Finds the next element of a list starting at pos, braces and quotes group an element
+  static bool nextListElement(std::string_view input, size_t & pos, size_t & start, size_t & length)
+  {
+    const size_t len = input.size();
+
+    while (pos < len && isspace(input[pos]))
+      ++pos;
+
+    if (pos >= len)
+      return false;
+
+    start = pos;
+
+    if (input[pos] == '{')
+    {
+      int level = 1;
+      start = ++pos;
+
+      for (; pos < len; ++pos)
+      {
+        if (input[pos] == '\\' && pos + 1 < len)
+          ++pos;
+        else if (input[pos] == '{')
+          ++level;
+        else if (input[pos] == '}' && --level == 0)
+          break;
+      }
+
+      length = pos - start;
+      if (pos < len)
+        ++pos;
+    }
+    else if (input[pos] == '"')
+    {
+      start = ++pos;
+
+      for (; pos < len && input[pos] != '"'; ++pos)
+        if (input[pos] == '\\' && pos + 1 < len)
+          ++pos;
+
+      length = pos - start;
+      if (pos < len)
+        ++pos;
+    }
+    else
+    {
+      while (pos < len && !isspace(input[pos]))
+        ++pos;
+
+      length = pos - start;
+    }
+
+    return true;
+  }
+
+  // Splits a list into its elements
+  void parseList(std::string const& input, std::vector<std::string> & result)
+  {
+    size_t pos = 0, start, length;
+    while (nextListElement(input, pos, start, length))
+      result.push_back(input.substr(start, length));
+  }
+
+  static bool needsBraces(std::string_view element)
+  {
+    if (element.empty())
+      return true;
+
+    for (size_t i = 0; i < element.size(); ++i)
+      if (isspace(element[i]) || strchr("{}\"\\[]$;", element[i]))
+        return true;
+
+    return false;
+  }
+
+  // -- Value --
+
+  Value::Value(std::string const& str)
+    : rep(std::make_shared<Rep>())
+  {
+    rep->string = str;
+  }
+
+  Value::Value(std::string && str)
+    : rep(std::make_shared<Rep>())
+  {
+    rep->string = std::move(str);
+  }
+
+  Value::Value(const char * str)
+  {
+    if (*str)
+    {
+      rep = std::make_shared<Rep>();
+      rep->string = str;
+    }
+  }
+
+  Value Value::fromInt(int64_t value)
+  {
+    Value result;
+    result.setInt(value);
+    return result;
+  }
+
+  Value Value::fromDouble(double value)
+  {
+    Value result;
+    result.setDouble(value);
+    return result;
+  }
+
+  Value Value::fromExternal(std::shared_ptr<void const> const& owner, std::string_view text)
+  {
+    Value result;
+    if (!text.empty())
+    {
+      result.rep = std::make_shared<Rep>();
+      result.rep->owner = owner;
+      result.rep->external = text;
+      result.rep->stringValid = false;
+    }
+    return result;
+  }
+
+  Value Value::fromList(std::vector<Value> && elements)
+  {
+    Value result;
+    result.rep = std::make_shared<Rep>();
+    result.rep->list = std::make_shared<std::vector<Value> >(std::move(elements));
+    result.rep->stringValid = false;
+    return result;
+  }
+
+  Value Value::fromNumbers(NumberArrayPtr const& numbers)
+  {
+    Value result;
+    result.rep = std::make_shared<Rep>();
+    result.rep->numbers = numbers;
+    result.rep->stringValid = false;
+    return result;
+  }
+
+  // Representations are shared between copies, only modify one nobody else sees
+  Value::Rep * Value::unique()
+  {
+    if (!rep || rep.use_count() != 1)
+      rep = std::make_shared<Rep>();
+
+    rep->owner.reset();
+    rep->external = std::string_view();
+    rep->list.reset();
+    rep->numbers.reset();
+    rep->cachedType = 0;
+    rep->cachedData.reset();
+    return rep.get();
+  }
+
+  std::string const& Value::str() const
+  {
+    static const std::string empty;
+
+    if (!rep)
+      return empty;
+
+    if (!rep->stringValid)
+    {
+      if (rep->owner)
+        rep->string.assign(rep->external.data(), rep->external.size());
+      else if (rep->list)
+      {
+        std::vector<Value> const& list = *rep->list;
+        for (size_t i = 0; i < list.size(); ++i)
+        {
+          std::string_view element = list[i].view();
+          if (i > 0)
+            rep->string += ' ';
+
+          if (needsBraces(element))
+          {
+            rep->string += '{';
+            rep->string.append(element.data(), element.size());
+            rep->string += '}';
+          }
+          else
+            rep->string.append(element.data(), element.size());
+        }
+      }
+      else if (rep->numbers)
+      {
+        NumberArray const& numbers = *rep->numbers;
+        char buf[64];
+        for (size_t i = 0; i < numbers.size(); ++i)
+        {
+          if (numbers.isInt)
+            snprintf(buf, 64, i > 0 ? " %lld" : "%lld", (long long)numbers.ints[i]);
+          else
+            snprintf(buf, 64, i > 0 ? " %f" : "%f", numbers.doubles[i]);
+
+          rep->string += buf;
+        }
+      }
+      else
+      {
+        char buf[64];
+        if (rep->numeric == NUM_INT)
+          snprintf(buf, 64, "%lld", (long long)rep->intValue);
+        else
+          snprintf(buf, 64, "%f", rep->doubleValue);
+
+        rep->string = buf;
+      }
+
+      rep->stringValid = true;
+    }
+
+    return rep->string;
+  }
+
+  // Mapped text is handed out as is, everything else goes through the string
+  std::string_view Value::view() const
+  {
+    if (rep && rep->owner)
+      return rep->external;
+    return str();
+  }
+
+  bool Value::empty() const
+  {
+    if (!rep)
+      return true;
+    if (rep->owner)
+      return rep->external.empty();
+    if (rep->list)
+      return rep->list->empty();
+    if (rep->numbers)
+      return rep->numbers->size() == 0;
+    return rep->stringValid && rep->string.empty();
+  }
+
+  size_t Value::memoryUsage() const
+  {
+    if (!rep)
+      return 0;
+
+    size_t total = sizeof(Rep) + rep->string.capacity();
+    if (rep->list)
+      for (size_t i = 0; i < rep->list->size(); ++i)
+        total += (*rep->list)[i].memoryUsage();
+    if (rep->numbers)
+      total += rep->numbers->ints.capacity() * sizeof(int64_t) + rep->numbers->doubles.capacity() * sizeof(double);
+
+    return total;
+  }
+
+  std::vector<Value> const& Value::asList() const
+  {
+    static const std::vector<Value> empty;
+
+    if (!rep)
+      return empty;
+
+    if (!rep->list && rep->numbers)
+    {
+      NumberArray const& numbers = *rep->numbers;
+      std::vector<Value> elements;
+      elements.reserve(numbers.size());
+
+      for (size_t i = 0; i < numbers.size(); ++i)
+        elements.push_back(numbers.isInt ? fromInt(numbers.ints[i]) : fromDouble(numbers.doubles[i]));
+
+      rep->list = std::make_shared<std::vector<Value> >(std::move(elements));
+    }
+    else if (!rep->list)
+    {
+      std::vector<Value> elements;
+      std::string_view text = view();
+      size_t pos = 0, start, length;
+
+      while (nextListElement(text, pos, start, length))
+        elements.push_back(slice(start, length));
+
+      rep->list = std::make_shared<std::vector<Value> >(std::move(elements));
+    }
+
+    return *rep->list;
+  }
+
+  // Packs the elements of the list, null when one of them is not a number
+  NumberArrayPtr Value::asNumbers() const
+  {
+    if (!rep)
+      return std::make_shared<NumberArray>();
+
+    if (rep->numbers)
+      return rep->numbers;
+
+    std::vector<Value> const& list = asList();
+    std::shared_ptr<NumberArray> numbers = std::make_shared<NumberArray>();
+    numbers->ints.resize(list.size());
+
+    size_t i = 0;
+    while (i < list.size() && list[i].asInt(numbers->ints[i]))
+      ++i;
+
+    if (i < list.size())
+    {
+      numbers->isInt = false;
+      numbers->ints.clear();
+      numbers->doubles.resize(list.size());
+
+      for (i = 0; i < list.size(); ++i)
+        if (!list[i].asDouble(numbers->doubles[i]))
+          return NumberArrayPtr();
+    }
+
+    rep->numbers = numbers;
+    return rep->numbers;
+  }
+
+  std::shared_ptr<void> Value::cached(void const* type) const
+  {
+    if (!rep || rep->cachedType != type)
+      return std::shared_ptr<void>();
+    return rep->cachedData;
+  }
+
+  void Value::cache(void const* type, std::shared_ptr<void> const& data) const
+  {
+    if (!rep)
+      return;
+
+    rep->cachedType = type;
+    rep->cachedData = data;
+  }
+
+  // Slices of mapped text share the mapping, anything else is short enough to copy
+  Value Value::slice(size_t offset, size_t length) const
+  {
+    std::string_view text = view();
+    if (offset >= text.size())
+      return Value();
+
+    text = text.substr(offset, length);
+    if (rep->owner)
+      return fromExternal(rep->owner, text);
+    return Value(std::string(text));
+  }
+
+  Value Value::detach() const
+  {
+    if (!rep)
+      return Value();
+
+    if (rep->owner)
+      return fromExternal(rep->owner, rep->external);
+
+    // The text is rendered on a private copy, a detached value is never written to by whoever
+    // reads it. Packed numbers are never changed once built, so they are shared along with it.
+    if (rep->numbers && !rep->stringValid)
+    {
+      std::shared_ptr<const std::string> text = std::make_shared<const std::string>(fromNumbers(rep->numbers).str());
+      Value result = fromExternal(text, *text);
+      if (result.rep)
+        result.rep->numbers = rep->numbers;
+      return result;
+    }
+
+    std::shared_ptr<const std::string> text = std::make_shared<const std::string>(str());
+    return fromExternal(text, *text);
+  }
+
+  void Value::parse() const
+  {
+    // Lists are rendered first, mapped text is only parsed when short enough to be a number
+    if (rep->list || rep->numbers)
+      str();
+
+    char buf[64];
+    const char * str;
+    char * end = 0;
+
+    rep->numeric = NUM_NONE;
+
+    std::string_view text;
+    if (rep->stringValid)
+      text = rep->string;
+    else if (rep->owner && rep->external.size() < sizeof(buf))
+      text = rep->external;
+    else
+      return;
+
+    // The conversions stop at a NUL, so text containing one is trailing garbage like any other
+    if (text.empty() || memchr(text.data(), 0, text.size()))
+      return;
+
+    if (rep->stringValid)
+      str = rep->string.c_str();
+    else
+    {
+      memcpy(buf, text.data(), text.size());
+      buf[text.size()] = 0;
+      str = buf;
+    }
+
+    int64_t i = std::strtoll(str, &end, 10);
+    while (isspace(*end))
+      ++end;
+
+    if (end != str && *end == 0)
+    {
+      rep->intValue = i;
+      rep->doubleValue = (double)i;
+      rep->numeric = NUM_INT;
+      return;
+    }
+
+    double d = std::strtod(str, &end);
+    while (isspace(*end))
+      ++end;
+
+    if (end != str && *end == 0)
+    {
+      rep->doubleValue = d;
+      rep->numeric = NUM_DOUBLE;
+    }
+  }
+
+  bool Value::asInt(int64_t & out) const
+  {
+    if (!rep)
+      return false;
+
+    if (rep->numeric == NUM_UNKNOWN)
+      parse();
+
+    if (rep->numeric != NUM_INT)
+      return false;
+
+    out = rep->intValue;
+    return true;
+  }
+
+  bool Value::asDouble(double & out) const
+  {
+    if (!rep)
+      return false;
+
+    if (rep->numeric == NUM_UNKNOWN)
+      parse();
+
+    if (rep->numeric == NUM_INT)
+      out = (double)rep->intValue;
+    else if (rep->numeric == NUM_DOUBLE)
+      out = rep->doubleValue;
+    else
+      return false;
+
+    return true;
+  }
+
+  void Value::set(std::string const& str)
+  {
+    Rep * r = unique();
+    r->string = str;
+    r->stringValid = true;
+    r->numeric = NUM_UNKNOWN;
+  }
+
+  void Value::set(std::string && str)
+  {
+    Rep * r = unique();
+    r->string = std::move(str);
+    r->stringValid = true;
+    r->numeric = NUM_UNKNOWN;
+  }
+
+  void Value::setInt(int64_t value)
+  {
+    Rep * r = unique();
+    r->intValue = value;
+    r->doubleValue = (double)value;
+    r->numeric = NUM_INT;
+    r->stringValid = false;
+  }
+
+  void Value::setDouble(double value)
+  {
+    Rep * r = unique();
+    r->doubleValue = value;
+    r->numeric = NUM_DOUBLE;
+    r->stringValid = false;
+  }
+
   // -- Parser --
 
   enum Token
@@ -61,25 +585,43 @@ namespace tcl {
         token(EndOfLine),
         current(code.empty() ? 0 : code[0]),
         pos(0),
-        insideString(false)
+        insideString(false),
+        commandStart(true),
+        block(SIZE_MAX),
+        bits(0)
     { }
 
     bool next();
     void inc() { if (pos < code.size()) current = code[++pos]; }
+    void seek(size_t to) { pos = to; current = code[pos]; }
     bool eof() const { return len() <= 0; }
     size_t len() const { return code.size() - pos; }
 
-    std::string code;
+    // Skips ahead to the next of the given characters, all of them have to be structural
+    size_t find(const char * stops)
+    {
+      size_t at = nextStructural(code, pos, block, bits);
+      while (at < code.size() && !strchr(stops, code[at]))
+        at = nextStructural(code, at + 1, block, bits);
+      return at;
+    }
+
+    std::string const& code;
     std::string value;
     Token token;
     char current;
     size_t pos;
     bool insideString;
+    bool commandStart;
+
+    // Structural mask of the last block the scanner looked at
+    size_t block;
+    uint64_t bits;
   };
 
   inline bool isSeparator(char t)
   {
-    return t == ' ' || t == '\t' || t == '\n';
+    return t == ' ' || t == '\t' || t == '\n' || t == '\r';
   }
 
   static bool parseSeparator(Parser * p)
@@ -97,6 +639,7 @@ namespace tcl {
     return true;
   }
 
+  // Text between the braces is copied in spans, the scanner jumps from one brace or backslash to the next
   static bool parseBracet(Parser * p)
   {
     int level = 1;
@@ -105,33 +648,31 @@ namespace tcl {
 
     while (true)
     {
-      if (p->len() >= 2 && p->current == '\\')
+      size_t stop = p->find("{}\\");
+      p->value.append(p->code, p->pos, stop - p->pos);
+
+      if (stop == p->code.size())
       {
-        p->inc();
-        p->value += p->current;
+        p->seek(stop);
+        break;
       }
-      else if (p->len() == 0 || p->current == '}')
-      {
-        level--;
 
-        if (level == 0 || p->len() == 0)
-        {
-          if (!p->eof())
-            p->inc();
+      // A backslash keeps the next character from being counted, both are kept as they are
+      size_t length = p->code[stop] == '\\' && stop + 1 < p->code.size() ? 2 : 1;
 
-          p->token = String;
-          return true;
-        }
-      }
-      else if (p->current == '{')
+      if (p->code[stop] == '{')
+        ++level;
+      else if (p->code[stop] == '}' && --level == 0)
       {
-        level++;
+        p->seek(stop + 1);
+        break;
       }
 
-      p->value += p->current;
-      p->inc();
+      p->value.append(p->code, stop, length);
+      p->seek(stop + length);
     }
 
+    p->token = String;
     return true;
   }
 
@@ -152,33 +693,33 @@ namespace tcl {
 
     while (true)
     {
+      size_t stop = p->find("[]{}\\");
+      p->value.append(p->code, p->pos, stop - p->pos);
+      p->seek(stop);
+
       if (p->eof())
         break;
-      else if (p->current == '[' && innerLevel == 0)
+
+      if (p->current == '\\')
       {
-        outerLevel++;
+        // An escaped character is taken as is, without its backslash
+        if (p->len() >= 2)
+          ++stop;
       }
+      else if (p->current == '[' && innerLevel == 0)
+        outerLevel++;
       else if (p->current == ']' && innerLevel == 0)
       {
         if (--outerLevel == 0)
           break;
       }
-      else if (p->current == '\\')
-      {
-        p->inc();
-      }
       else if (p->current == '{')
-      {
         innerLevel++;
-      }
-      else if (p->current == '}')
-      {
-        if (innerLevel > 0)
-          innerLevel--;
-      }
+      else if (p->current == '}' && innerLevel > 0)
+        innerLevel--;
 
-      p->value += p->current;
-      p->inc();
+      p->value += p->code[stop];
+      p->seek(stop + 1);
     }
 
     if (p->current == ']')
@@ -289,6 +830,9 @@ namespace tcl {
   bool Parser::next()
   {
     value = "";
+    if (token != Separator)
+      commandStart = (token == EndOfLine);
+
     if (pos == code.size())
     {
       token = EndOfFile;
@@ -318,6 +862,8 @@ namespace tcl {
           return parseCommand(this);
 
         case '#':
+          if (!commandStart)
+            return parseString(this);
           parseComment(this);
           continue;
 
@@ -327,202 +873,1453 @@ namespace tcl {
     }
   }
 
-  // -- Build in functions --
+  // -- Compiler --
 
-  static ReturnCode builtInPuts(Context * ctx, ArgumentVector const& args, void * data)
+  enum PartType
   {
-    if (args.size() > 1)
-      for (size_t i = 1, len = args.size(); i < len; ++i)
-        std::cout << args[i] << (((i - 1) == len) ? "" : " ");
+    PART_LITERAL,
+    PART_VARIABLE,
+    PART_COMMAND
+  };
 
-    std::cout << std::endl;
+  struct CompiledPart
+  {
+    CompiledPart(PartType type, std::string text)
+      : type(type),
+        text(std::move(text))
+    { }
 
-    return RET_OK;
-  }
+    PartType type;
+    std::string text;
+    Value value;
+    CompiledScriptPtr script;
+  };
 
-  static ReturnCode builtInSet(Context * ctx, ArgumentVector const& args, void * data)
+  typedef std::vector<CompiledPart> CompiledWord;
+
+  struct CompiledCommand
   {
-    const size_t len = args.size();
+    CompiledCommand()
+      : tailReturn(false),
+        leavesResult(false),
+        folded(false)
+    { }
 
-    if (len == 2)
-    {
-      return ctx->current().get(args[1], ctx->current().result) ? RET_OK : RET_ERROR;
-    }
-    else if (len == 3)
-    {
-      ctx->current().result = args[2];
-      ctx->current().set(args[1], args[2]);
-      return RET_OK;
-    }
-    else
-      return ctx->arityError(args[0]);
-  }
+    std::vector<CompiledWord> words;
+    bool tailReturn;
+
+    // A folded substitution that would have been the last one run, commands that do not set a
+    // result of their own leave its value behind
+    bool leavesResult;
+    Value leftover;
+
+    // An 'if' with a constant condition, only the branch taken is run, if there is one
+    bool folded;
+    CompiledScriptPtr branch;
+  };
+
+  typedef std::vector<std::pair<std::string, ProcedureCallback> > AssumptionList;
+
+  struct CompiledScript
+  {
+    CompiledScript()
+      : checkedEpoch(0)
+    { }
+
+    std::vector<CompiledCommand> commands;
+
+    // Set by the optimizer, which command callbacks its folding relied on. The unoptimized
+    // original takes over from the first command run after one of them stopped holding.
+    AssumptionList assumptions;
+    CompiledScriptPtr original;
+
+    // The last procedure epoch the assumptions held for. Clones run the same scripts and epochs
+    // are unique to a context's state, so it is only atomic for them to race on it safely.
+    mutable std::atomic<uint64_t> checkedEpoch;
+  };
+
+  // The cache is bounded by bytes rather than entries, a script larger than a slice of the
+  // budget is compiled for its caller alone
+  static const size_t MaxCachedScriptBytes = 8 << 20;
+  static const size_t MaxCachedScriptSlice = 16;
+
+  static void appendLiteral(CompiledWord & word, std::string && text)
+  {
+    if (!word.empty() && word.back().type == PART_LITERAL)
+      word.back().text += text;
+    else
+      word.push_back(CompiledPart(PART_LITERAL, std::move(text)));
+  }
+
+  static void compileScript(Context * ctx, std::string const& code, CompiledScript & script)
+  {
+    Parser parser(code);
+    CompiledCommand command;
+
+    while (true)
+    {
+      Token previousToken = parser.token;
+      parser.next();
+
+      if (ctx->debug)
+        std::cout << "Token: " << tokenAsReadable[parser.token] << " = '" << parser.value << "'" << std::endl;
+
+      if (parser.token == Separator)
+        continue;
+
+      if (parser.token == EndOfLine || parser.token == EndOfFile)
+      {
+        if (!command.words.empty())
+        {
+          // Literals become shared values, every use of them only bumps a reference count
+          for (size_t i = 0; i < command.words.size(); ++i)
+            for (size_t j = 0; j < command.words[i].size(); ++j)
+              if (command.words[i][j].type == PART_LITERAL)
+                command.words[i][j].value = Value(std::move(command.words[i][j].text));
+
+          // 'return [proc ...]' is a candidate for a tail call, taken when the procedure calls itself
+          std::vector<CompiledWord> const& words = command.words;
+          command.tailReturn = words.size() == 2 &&
+                               words[0].size() == 1 && words[0][0].type == PART_LITERAL && words[0][0].value == "return" &&
+                               words[1].size() == 1 && words[1][0].type == PART_COMMAND;
+
+          script.commands.push_back(std::move(command));
+          command = CompiledCommand();
+        }
+
+        if (parser.token == EndOfFile)
+          break;
+        continue;
+      }
+
+      if (previousToken == Separator || previousToken == EndOfLine || command.words.empty())
+        command.words.push_back(CompiledWord());
+
+      CompiledWord & word = command.words.back();
+
+      if (parser.token == Variable)
+      {
+        word.push_back(CompiledPart(PART_VARIABLE, parser.value));
+      }
+      else if (parser.token == Command)
+      {
+        word.push_back(CompiledPart(PART_COMMAND, ""));
+        word.back().script = std::make_shared<CompiledScript>();
+        compileScript(ctx, parser.value, *word.back().script);
+      }
+      else
+      {
+        // The parser starts a fresh value for the next token, a big literal is not copied
+        appendLiteral(word, std::move(parser.value));
+      }
+    }
+  }
+
+  // Runs a pending tail call that could not be turned into a frame reuse
+  bool flushTailCall(Context * ctx)
+  {
+    if (ctx->tailCall.empty())
+      return true;
+
+    ArgumentVector call;
+    call.swap(ctx->tailCall);
+    return !failed(ctx->invoke(call));
+  }
+
+  static bool substitutePart(Context * ctx, CompiledPart const& part, Value & out)
+  {
+    if (part.type == PART_LITERAL)
+    {
+      out = part.value;
+    }
+    else if (part.type == PART_VARIABLE)
+    {
+      Value const* value = ctx->current().get(part.text);
+      if (!value)
+      {
+        ctx->reportError("Could not locate variable '" + part.text + "'");
+        return false;
+      }
+
+      out = *value;
+    }
+    else
+    {
+      if (failed(ctx->execute(*part.script)) || !flushTailCall(ctx))
+        return false;
+
+      out = ctx->current().result;
+    }
+
+    return true;
+  }
+
+  static bool substitute(Context * ctx, CompiledWord const& word, Value & out)
+  {
+    // A word made of one part shares its value, only real concatenations build a new string
+    if (word.size() == 1)
+      return substitutePart(ctx, word[0], out);
+
+    std::string str;
+    Value part;
+
+    for (size_t i = 0, len = word.size(); i < len; ++i)
+    {
+      if (!substitutePart(ctx, word[i], part))
+        return false;
+
+      str += part.view();
+    }
+
+    // Concatenation is where strings grow, so it is checked right away instead of every few hundred commands
+    if (ctx->limits.memory && str.size() > ctx->limits.memory && !ctx->limitExceeded(LIMIT_MEMORY))
+      return false;
+
+    out = Value(std::move(str));
+    return true;
+  }
+
+  static ReturnCode testCondition(Context * ctx, CompiledExpr const& condition, bool & result)
+  {
+    double value;
+    if (!evaluateExpression(ctx, condition, value))
+      return ctx->failure();
+
+    result = value > 0.0;
+    return RET_OK;
+  }
+
+  // -- Build in functions --
+
+  static ReturnCode builtInPuts(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() > 1)
+      for (size_t i = 1, len = args.size(); i < len; ++i)
+        std::cout << args[i].view() << (((i - 1) == len) ? "" : " ");
+
+    std::cout << std::endl;
+
+    return RET_OK;
+  }
+
+  static ReturnCode builtInSet(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    const size_t len = args.size();
+
+    if (len == 2)
+    {
+      Value const* value = ctx->current().get(args[1].str());
+      if (!value)
+        return RET_ERROR;
+
+      ctx->current().result = *value;
+      return RET_OK;
+    }
+    else if (len == 3)
+    {
+      ctx->current().set(args[1].str(), args[2]);
+      ctx->current().result = args[2];
+      return RET_OK;
+    }
+    else
+      return ctx->arityError(args[0].str());
+  }
 
   static ReturnCode builtInExpr(Context * ctx, ArgumentVector const& args, void * data)
   {
     if (args.size() == 1)
-      return ctx->arityError(args[0]);
+      return ctx->arityError(args[0].str());
 
     std::string str;
     for (size_t i = 1; i < args.size(); ++i)
-      str += args[i];
+      str += args[i].view();
 
     ctx->reportError("");
     double result = calculateExpr(ctx, str);
-    char buf[128];
-    snprintf(buf, 128, "%f", result);
-    ctx->current().result = std::string(buf);
-    return ctx->error.empty() ? RET_OK : RET_ERROR;
+    ctx->current().result.setDouble(result);
+    return ctx->error.empty() ? RET_OK : ctx->failure();
   }
 
   static ReturnCode builtInIf(Context * ctx, ArgumentVector const& args, void * data)
   {
     if (args.size() != 3 && args.size() != 5)
-      return ctx->arityError(args[0]);
+      return ctx->arityError(args[0].str());
 
-    double result = calculateExpr(ctx, args[1]);
+    ctx->reportError("");
+    double result = calculateExpr(ctx, args[1].str());
+    if (!ctx->error.empty())
+      return ctx->failure();
 
     if (result > 0.0)
-      return ctx->evaluate(args[2]);
+      return ctx->evaluate(args[2].str());
     else if (args.size() == 5)
-      return ctx->evaluate(args[4]);
+      return ctx->evaluate(args[4].str());
 
     return RET_OK;
   }
 
+  // Results of a pure procedure keyed on its arguments, the least recently used are dropped
+  struct MemoCache
+  {
+    typedef std::list<std::pair<std::string, Value> > EntryList;
+
+    MemoCache(size_t capacity)
+      : capacity(capacity),
+        hits(0),
+        misses(0)
+    { }
+
+    Value const* find(std::string const& key)
+    {
+      std::unordered_map<std::string, EntryList::iterator>::iterator it = index.find(key);
+      if (it == index.end())
+      {
+        ++misses;
+        return 0;
+      }
+
+      ++hits;
+      entries.splice(entries.begin(), entries, it->second);
+      return &it->second->second;
+    }
+
+    void insert(std::string const& key, Value const& result)
+    {
+      if (capacity == 0 || index.count(key))
+        return;
+
+      if (entries.size() >= capacity)
+      {
+        index.erase(entries.back().first);
+        entries.pop_back();
+      }
+
+      entries.push_front(std::make_pair(key, result));
+      index[key] = entries.begin();
+    }
+
+    // The same entries in the same order, the statistics start over
+    MemoCache * copy() const
+    {
+      MemoCache * memo = new MemoCache(capacity);
+      for (EntryList::const_reverse_iterator it = entries.rbegin(); it != entries.rend(); ++it)
+        memo->insert(it->first, it->second);
+      return memo;
+    }
+
+    size_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+    EntryList entries;
+    std::unordered_map<std::string, EntryList::iterator> index;
+  };
+
+  static const size_t DefaultMemoSize = 1024;
+
+  // The memo lives with the definition, redefining a procedure starts with an empty cache
   struct ProcData
   {
+    ProcData()
+      : shared(false)
+    { }
+
     std::vector<std::string> arguments;
-    std::string body;
+    CompiledScriptPtr body;
+    std::unique_ptr<MemoCache> memo;
+
+    // Set once a clone can see the definition, from then on it is not changed
+    bool shared;
   };
 
+  static ReturnCode builtInProcExec(Context * ctx, ArgumentVector const& args, void * data);
+
+  // Installs a private copy of a shared definition before its memo is touched, a clone keeps the original.
+  // Returns null when the name no longer refers to this definition.
+  static std::shared_ptr<ProcData> ownProcData(Context * ctx, std::string const& name, ProcData * procData)
+  {
+    Procedure const* proc = ctx->findProc(name);
+    if (!proc || proc->data != procData)
+      return std::shared_ptr<ProcData>();
+
+    std::shared_ptr<ProcData> copy = std::make_shared<ProcData>();
+    copy->arguments = procData->arguments;
+    copy->body = procData->body;
+    if (procData->memo)
+      copy->memo.reset(procData->memo->copy());
+
+    ctx->replaceProc(name, Procedure(builtInProcExec, copy.get(), copy));
+    return copy;
+  }
+
+  // Arguments are length prefixed so that no two argument vectors share a key
+  static std::string memoKey(ArgumentVector const& args)
+  {
+    std::string key;
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+      std::string_view arg = args[i].view();
+      key += std::to_string(arg.size());
+      key += ':';
+      key.append(arg.data(), arg.size());
+    }
+    return key;
+  }
+
   static ReturnCode builtInProcExec(Context * ctx, ArgumentVector const& args, void * data)
   {
     if (!data)
-      return ctx->reportError("Runtime error in '" + args[0] + "'");
+      return ctx->reportError("Runtime error in '" + args[0].str() + "'");
 
     ProcData * procData = static_cast<ProcData *>(data);
 
     if ((args.size() - 1) != procData->arguments.size())
-      return ctx->reportError("Procedure '" + args[0] + "' called with wrong number of arguments");
+      return ctx->reportError("Procedure '" + args[0].str() + "' called with wrong number of arguments");
+
+    // Held for the call, the body may redefine the procedure and drop the copy from the map
+    std::shared_ptr<ProcData> own;
+    if (procData->memo && procData->shared)
+    {
+      own = ownProcData(ctx, args[0].str(), procData);
+      if (own)
+        procData = own.get();
+    }
+
+    // The body may replace the memo while it runs, so it is looked up again when storing
+    ProcData * memoized = procData->memo && !procData->shared ? procData : 0;
+    std::string key;
+    if (memoized)
+    {
+      key = memoKey(args);
+      if (Value const* cached = memoized->memo->find(key))
+      {
+        ctx->current().result = *cached;
+        return RET_OK;
+      }
+    }
 
     ctx->frames.push_back(CallFrame());
+    ctx->current().procedure = procData;
+    if (ctx->checkDepth() != RET_OK)
+    {
+      ctx->frames.pop_back();
+      return RET_LIMIT;
+    }
+
+    ArgumentVector const* callArgs = &args;
+    ArgumentVector tail;
+    std::shared_ptr<void> definition;
+    ReturnCode retCode;
+
+    // A tail call into a script procedure reuses the frame instead of recursing, the frame stays where
+    // the caller's was, so upvar in the callee still sees the caller's caller. Only an explicit
+    // tailcall gets here for another procedure, 'return [proc ...]' is only converted for itself.
+    while (true)
+    {
+      for (size_t i = 0, len = procData->arguments.size(); i < len; ++i)
+        ctx->current().set(procData->arguments[i], (*callArgs)[i + 1]);
+
+      retCode = ctx->execute(*procData->body);
+      if (retCode != RET_RETURN || ctx->tailCall.empty())
+        break;
+
+      tail.swap(ctx->tailCall);
+      ctx->tailCall.clear();
+
+      Procedure const* proc = ctx->findProc(tail[0].str());
+      if (!proc)
+      {
+        retCode = ctx->reportError("Could not find procedure '" + tail[0].str() + "'");
+        break;
+      }
+
+      if (proc->callback != builtInProcExec || !proc->data)
+      {
+        ctx->frames.pop_back();
+        return ctx->invoke(tail);
+      }
+
+      // Held while it runs, its body may redefine it
+      definition = proc->owner;
+      procData = static_cast<ProcData *>(proc->data);
+      ctx->current().procedure = procData;
+
+      if ((tail.size() - 1) != procData->arguments.size())
+      {
+        retCode = ctx->reportError("Procedure '" + tail[0].str() + "' called with wrong number of arguments");
+        break;
+      }
+
+      ctx->current().variables.clear();
+      ctx->current().result = Value();
+      callArgs = &tail;
+
+      // Frame reuse skips dispatch, so the command still has to be counted here
+      retCode = ctx->tick();
+      if (retCode != RET_OK)
+        break;
+    }
 
-    // Setup arguments
-    for (size_t i = 0, len = procData->arguments.size(); i < len; ++i)
-      ctx->current().set(procData->arguments[i], args[i + 1]);
+    ctx->tailCall.clear();
 
-    ReturnCode retCode = ctx->evaluate(procData->body);
-    std::string result = ctx->current().result;
+    Value result = std::move(ctx->current().result);
     ctx->frames.pop_back();
-    ctx->current().result = result;
+    ctx->current().result = std::move(result);
 
-    return retCode;
+    if (memoized && memoized->memo && (retCode == RET_OK || retCode == RET_RETURN))
+      memoized->memo->insert(key, ctx->current().result);
+
+    return retCode == RET_RETURN ? RET_OK : retCode;
   }
 
   static ReturnCode builtInProc(Context * ctx, ArgumentVector const& args, void * data)
   {
-    if (args.size() != 4)
-      return ctx->arityError(args[0]);
+    const bool memoized = args.size() == 5 && args[1] == "-memo";
+    if (args.size() != 4 && !memoized)
+      return ctx->arityError(args[0].str());
+
+    const size_t first = memoized ? 2 : 1;
+
+    std::shared_ptr<ProcData> procData = std::make_shared<ProcData>();
+    procData->body = ctx->compile(args[first + 2].str());
+    split(args[first + 1].str(), " \t", procData->arguments);
+    if (memoized)
+      procData->memo.reset(new MemoCache(DefaultMemoSize));
+
+    ctx->replaceProc(args[first].str(), Procedure(builtInProcExec, procData.get(), procData));
+    ctx->current().result = Value();
+    return RET_OK;
+  }
+
+  // rename oldName newName, an empty new name deletes the procedure
+  static ReturnCode builtInRename(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    if (!ctx->renameProc(args[1].str(), args[2].str()))
+      return RET_ERROR;
+
+    ctx->current().result = Value();
+    return RET_OK;
+  }
+
+  // apply {arguments body} ?arg ...?, the lambda is compiled once and cached on the value
+  static ReturnCode builtInApply(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() < 2)
+      return ctx->arityError(args[0].str());
+
+    static const char lambdaType = 0;
+    std::shared_ptr<ProcData> procData = std::static_pointer_cast<ProcData>(args[1].cached(&lambdaType));
+
+    if (!procData)
+    {
+      std::vector<Value> const& lambda = args[1].asList();
+      if (lambda.size() != 2)
+        return ctx->reportError("Expected a lambda of arguments and body but got '" + args[1].str() + "'");
+
+      procData = std::make_shared<ProcData>();
+      procData->body = ctx->compile(lambda[1].str());
+      split(lambda[0].str(), " \t", procData->arguments);
+      args[1].cache(&lambdaType, procData);
+    }
+
+    ArgumentVector call(args.begin() + 1, args.end());
+    return builtInProcExec(ctx, call, procData.get());
+  }
+
+  // memoize name ?size?, memoize -stats name or memoize -clear name
+  static ReturnCode builtInMemoize(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2 && args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    const bool option = args[1] == "-stats" || args[1] == "-clear";
+    if (option && args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    std::string const& name = args[option ? 2 : 1].str();
+
+    Procedure const* proc = ctx->findProc(name);
+    if (!proc || proc->callback != builtInProcExec)
+      return ctx->reportError("'" + name + "' is not a procedure defined with proc");
+
+    ProcData * procData = static_cast<ProcData *>(proc->data);
+
+    if (args[1] == "-stats")
+    {
+      MemoCache * memo = procData->memo.get();
+      ctx->current().result = Value("hits " + std::to_string(memo ? memo->hits : 0) +
+                                    " misses " + std::to_string(memo ? memo->misses : 0) +
+                                    " entries " + std::to_string(memo ? memo->entries.size() : 0));
+      return RET_OK;
+    }
 
-    ProcData * procData = new ProcData;
-    procData->body = args[3];
-    split(args[2], " \t", procData->arguments);
+    if (procData->shared)
+      procData = ownProcData(ctx, name, procData).get();
 
-    return ctx->registerProc(args[1], builtInProcExec, procData) ? RET_OK : RET_ERROR;
+    int64_t size = DefaultMemoSize;
+    if (args[1] == "-clear")
+      size = procData->memo ? procData->memo->capacity : 0;
+    else if (args.size() == 3 && (!args[2].asInt(size) || size < 0))
+      return ctx->reportError("Expected a cache size but got '" + args[2].str() + "'");
+
+    // A size of zero turns memoization off again
+    procData->memo.reset(size > 0 ? new MemoCache(size) : 0);
+    ctx->current().result = Value();
+    return RET_OK;
   }
 
   static ReturnCode builtInReturn(Context * ctx, ArgumentVector const& args, void * data)
   {
     if (args.size() != 2)
-      return ctx->arityError(args[0]);
+      return ctx->arityError(args[0].str());
 
     ctx->current().result = args[1];
     return RET_RETURN;
   }
 
-  static ReturnCode builtInError(Context * ctx, ArgumentVector const& args, void * data)
+  static ReturnCode builtInTailcall(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() < 2)
+      return ctx->arityError(args[0].str());
+
+    if (ctx->frames.size() == 1)
+      return ctx->reportError("'" + args[0].str() + "' can only be called from a procedure");
+
+    ctx->tailCall.assign(args.begin() + 1, args.end());
+    return RET_RETURN;
+  }
+
+  static bool findFrame(Context * ctx, std::string const& level, size_t & index)
+  {
+    char * end = 0;
+
+    if (!level.empty() && level[0] == '#')
+    {
+      long absolute = std::strtol(level.c_str() + 1, &end, 10);
+      if (*end || absolute < 0 || absolute >= (long)ctx->frames.size())
+        return false;
+      index = absolute;
+      return true;
+    }
+
+    long relative = std::strtol(level.c_str(), &end, 10);
+    if (level.empty() || *end || relative < 0 || relative >= (long)ctx->frames.size())
+      return false;
+    index = ctx->frames.size() - 1 - relative;
+    return true;
+  }
+
+  static ReturnCode builtInUpvar(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    size_t first = 1;
+    size_t index = ctx->frames.size() > 1 ? ctx->frames.size() - 2 : 0;
+
+    if (args.size() % 2 == 0)
+    {
+      if (!findFrame(ctx, args[1].str(), index))
+        return ctx->reportError("Bad level '" + args[1].str() + "'");
+      first = 2;
+    }
+
+    if (args.size() - first < 2)
+      return ctx->arityError(args[0].str());
+
+    CallFrame & frame = ctx->frames[index];
+    for (size_t i = first; i + 1 < args.size(); i += 2)
+    {
+      if (&frame == &ctx->current() && args[i] == args[i + 1])
+        continue;
+      ctx->current().link(args[i + 1].str(), frame.slot(args[i].str()));
+    }
+
+    return RET_OK;
+  }
+
+  static ReturnCode builtInGlobal(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() < 2)
+      return ctx->arityError(args[0].str());
+
+    if (ctx->frames.size() == 1)
+      return RET_OK;
+
+    for (size_t i = 1; i < args.size(); ++i)
+      ctx->current().link(args[i].str(), ctx->frames.front().slot(args[i].str()));
+
+    return RET_OK;
+  }
+
+  static ReturnCode builtInVariable(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() < 2)
+      return ctx->arityError(args[0].str());
+
+    for (size_t i = 1; i < args.size(); i += 2)
+    {
+      VariablePtr & var = ctx->frames.front().slot(args[i].str());
+      if (i + 1 < args.size())
+        var->value = args[i + 1];
+
+      if (ctx->frames.size() > 1)
+        ctx->current().link(args[i].str(), var);
+    }
+
+    return RET_OK;
+  }
+
+  static ReturnCode builtInError(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2)
+      return ctx->arityError(args[0].str());
+    return ctx->reportError(args[1].str());
+  }
+
+  static ReturnCode builtInEval(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2)
+      return ctx->arityError(args[0].str());
+
+    std::string str;
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+      str += args[i].view();
+      str += ' ';
+    }
+
+    return ctx->evaluate(str);
+  }
+
+  static ReturnCode builtInWhile(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    CompiledExprPtr condition = compileExpression(ctx, args[1].str());
+    if (!condition)
+      return RET_ERROR;
+
+    CompiledScriptPtr body = ctx->compile(args[2].str());
+    bool test;
+
+    while (true)
+    {
+      ReturnCode retCode = ctx->tick();
+      if (retCode == RET_OK)
+        retCode = testCondition(ctx, *condition, test);
+      if (retCode != RET_OK)
+        return retCode;
+
+      if (!test)
+        break;
+
+      retCode = ctx->execute(*body);
+      if (retCode == RET_BREAK)
+        break;
+      else if (retCode != RET_OK && retCode != RET_CONTINUE)
+        return retCode;
+    }
+
+    ctx->current().result = Value();
+    return RET_OK;
+  }
+
+  static ReturnCode builtInFor(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 5)
+      return ctx->arityError(args[0].str());
+
+    ReturnCode retCode = ctx->evaluate(args[1].str());
+    if (retCode != RET_OK)
+      return retCode;
+
+    CompiledExprPtr condition = compileExpression(ctx, args[2].str());
+    if (!condition)
+      return RET_ERROR;
+
+    CompiledScriptPtr next = ctx->compile(args[3].str());
+    CompiledScriptPtr body = ctx->compile(args[4].str());
+    bool test;
+
+    while (true)
+    {
+      retCode = ctx->tick();
+      if (retCode == RET_OK)
+        retCode = testCondition(ctx, *condition, test);
+      if (retCode != RET_OK)
+        return retCode;
+
+      if (!test)
+        break;
+
+      retCode = ctx->execute(*body);
+      if (retCode == RET_BREAK)
+        break;
+      else if (retCode != RET_OK && retCode != RET_CONTINUE)
+        return retCode;
+
+      retCode = ctx->execute(*next);
+      if (retCode != RET_OK)
+        return retCode;
+    }
+
+    ctx->current().result = Value();
+    return RET_OK;
+  }
+
+  static ReturnCode builtInForeach(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 4)
+      return ctx->arityError(args[0].str());
+
+    std::vector<std::string> names;
+    parseList(args[1].str(), names);
+    if (names.empty())
+      return ctx->reportError("'" + args[0].str() + "' needs at least one variable");
+
+    // Lists produced by split or sliced from a mapped file are walked without copying
+    std::vector<Value> const& items = args[2].asList();
+
+    // Resolve the loop variables once, every iteration writes straight into the slots
+    std::vector<VariablePtr> slots;
+    for (size_t i = 0; i < names.size(); ++i)
+      slots.push_back(ctx->current().slot(names[i]));
+
+    CompiledScriptPtr body = ctx->compile(args[3].str());
+
+    for (size_t i = 0; i < items.size(); i += slots.size())
+    {
+      if (ctx->tick() != RET_OK)
+        return RET_LIMIT;
+
+      for (size_t j = 0; j < slots.size(); ++j)
+      {
+        if (i + j < items.size())
+          slots[j]->value = items[i + j];
+        else
+          slots[j]->value = Value();
+      }
+
+      ReturnCode retCode = ctx->execute(*body);
+      if (retCode == RET_BREAK)
+        break;
+      else if (retCode != RET_OK && retCode != RET_CONTINUE)
+        return retCode;
+    }
+
+    ctx->current().result = Value();
+    return RET_OK;
+  }
+
+  static ReturnCode buildInRetCode(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args[0] == "break")
+      return RET_BREAK;
+    return RET_CONTINUE;
+  }
+
+  static ReturnCode builtInIncr(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2 && args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    Value * found = ctx->current().find(args[1].str());
+    if (!found)
+      return ctx->reportError("Could not find variable '" + args[1].str() + "'");
+
+    Value & var = *found;
+    int64_t inc = 1;
+    int64_t value;
+
+    if (!convertInt(ctx, var, value))
+      return RET_ERROR;
+
+    if (args.size() == 3 && !convertInt(ctx, args[2], inc))
+      return RET_ERROR;
+
+    var.setInt(value + inc);
+    ctx->current().result = var;
+    return RET_OK;
+  }
+
+  static ReturnCode builtInMmap(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2)
+      return ctx->arityError(args[0].str());
+
+    Value result;
+    if (!mapFile(ctx, args[1].str(), result))
+      return RET_ERROR;
+
+    ctx->current().result = std::move(result);
+    return RET_OK;
+  }
+
+  // Parses an index that may be relative to the end, like end or end-1
+  static bool parseIndex(Context * ctx, Value const& arg, int64_t length, int64_t & index)
+  {
+    if (arg.asInt(index))
+      return true;
+
+    std::string_view text = arg.view();
+    if (text.substr(0, 3) == "end")
+    {
+      int64_t offset = 0;
+      if (text.size() == 3 || (Value(std::string(text.substr(3))).asInt(offset) && (text[3] == '-' || text[3] == '+')))
+      {
+        index = length - 1 + offset;
+        return true;
+      }
+    }
+
+    ctx->reportError("Bad index '" + arg.str() + "'");
+    return false;
+  }
+
+  static ReturnCode builtInString(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() < 3)
+      return ctx->arityError(args[0].str());
+
+    Value const& command = args[1];
+    std::string_view text = args[2].view();
+    const int64_t length = (int64_t)text.size();
+
+    if (command == "length" && args.size() == 3)
+      ctx->current().result.setInt(length);
+    else if (command == "index" && args.size() == 4)
+    {
+      int64_t index;
+      if (!parseIndex(ctx, args[3], length, index))
+        return RET_ERROR;
+
+      ctx->current().result = index < 0 ? Value() : args[2].slice(index, 1);
+    }
+    else if (command == "range" && args.size() == 5)
+    {
+      int64_t first, last;
+      if (!parseIndex(ctx, args[3], length, first) || !parseIndex(ctx, args[4], length, last))
+        return RET_ERROR;
+
+      first = std::max<int64_t>(first, 0);
+      last = std::min<int64_t>(last, length - 1);
+      ctx->current().result = first > last ? Value() : args[2].slice(first, last - first + 1);
+    }
+    else if ((command == "first" || command == "last") && args.size() == 4)
+    {
+      // Searches for the first argument in the second, like Tcl does
+      std::string_view haystack = args[3].view();
+      size_t pos = command == "first" ? haystack.find(text) : haystack.rfind(text);
+      ctx->current().result.setInt(pos == std::string_view::npos ? -1 : (int64_t)pos);
+    }
+    else if (command == "equal" && args.size() == 4)
+      ctx->current().result.setInt(text == args[3].view() ? 1 : 0);
+    else if (command == "compare" && args.size() == 4)
+    {
+      int result = text.compare(args[3].view());
+      ctx->current().result.setInt(result < 0 ? -1 : (result > 0 ? 1 : 0));
+    }
+    else
+      return ctx->reportError("Unknown or malformed subcommand '" + command.str() + "' to '" + args[0].str() + "'");
+
+    return RET_OK;
+  }
+
+  static ReturnCode builtInSplit(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2 && args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    Value const& input = args[1];
+    std::string_view text = input.view();
+    std::string_view delims = args.size() == 3 ? args[2].view() : std::string_view(" \t\n\r");
+    std::vector<Value> elements;
+
+    if (delims.empty())
+    {
+      for (size_t i = 0; i < text.size(); ++i)
+        elements.push_back(input.slice(i, 1));
+    }
+    else if (!text.empty())
+    {
+      size_t start = 0;
+      for (size_t i = 0; i < text.size(); ++i)
+      {
+        if (delims.find(text[i]) != std::string_view::npos)
+        {
+          elements.push_back(input.slice(start, i - start));
+          start = i + 1;
+        }
+      }
+
+      elements.push_back(input.slice(start, text.size() - start));
+    }
+
+    ctx->current().result = Value::fromList(std::move(elements));
+    return RET_OK;
+  }
+
+  static ReturnCode builtInLindex(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    std::vector<Value> const& list = args[1].asList();
+    int64_t index;
+    if (!parseIndex(ctx, args[2], (int64_t)list.size(), index))
+      return RET_ERROR;
+
+    ctx->current().result = index < 0 || index >= (int64_t)list.size() ? Value() : list[index];
+    return RET_OK;
+  }
+
+  static ReturnCode builtInLlength(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2)
+      return ctx->arityError(args[0].str());
+
+    ctx->current().result.setInt((int64_t)args[1].asList().size());
+    return RET_OK;
+  }
+
+  static ReturnCode builtInBinary(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() >= 3 && args[1] == "format")
+      return binaryFormat(ctx, args);
+    else if (args.size() >= 4 && args[1] == "scan")
+      return binaryScan(ctx, args);
+
+    return ctx->arityError(args[0].str());
+  }
+
+  // A child runs on what is left of the parent's budgets, tightened by its own, and its commands are
+  // charged to the parent afterwards. interp eval is no way around the limits of the caller.
+  // A child without a handler of its own answers to the parent's, called with the child.
+  static ReturnCode evaluateChild(Context * ctx, Context * child, std::string const& code)
+  {
+    const Limits saved = child->limits;
+    const uint64_t savedCount = child->commandCount;
+
+    Limits limits = saved;
+    if (saved.commands)
+      limits.commands = saved.commands > savedCount ? saved.commands - savedCount : 1;
+    if (ctx->limits.commands)
+    {
+      uint64_t left = ctx->limits.commands > ctx->commandCount ? ctx->limits.commands - ctx->commandCount : 1;
+      limits.commands = limits.commands ? std::min(limits.commands, left) : left;
+    }
+
+    limits.deadline = std::min(limits.deadline, ctx->limits.deadline);
+
+    if (ctx->limits.depth)
+    {
+      size_t left = ctx->limits.depth > ctx->frames.size() ? ctx->limits.depth - ctx->frames.size() + 1 : 1;
+      limits.depth = limits.depth ? std::min(limits.depth, left) : left;
+    }
+
+    if (ctx->limits.memory)
+    {
+      size_t used = ctx->memoryUsage();
+      size_t left = ctx->limits.memory > used ? ctx->limits.memory - used : 1;
+      limits.memory = limits.memory ? std::min(limits.memory, left) : left;
+    }
+
+    LimitHandler handler = child->limitHandler ? child->limitHandler : ctx->limitHandler;
+    void * handlerData = child->limitHandler ? child->limitData : ctx->limitData;
+    LimitHandler savedHandler = child->limitHandler;
+    void * savedData = child->limitData;
+
+    child->setLimits(limits, handler, handlerData);
+    ReturnCode retCode = child->evaluate(code);
+    const uint64_t used = child->commandCount;
+
+    child->setLimits(saved, savedHandler, savedData);
+    child->commandCount = savedCount + used;
+
+    ctx->commandCount += used;
+    ReturnCode limitCode = ctx->checkLimits();
+    if (limitCode != RET_OK)
+      return limitCode;
+
+    if (failed(retCode))
+      ctx->reportError(child->error);
+
+    // The callers of the parent unwind as for a limit of their own
+    if (retCode == RET_LIMIT)
+      ctx->limitReached = true;
+    return retCode;
+  }
+
+  static ReturnCode builtInInterp(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() < 2)
+      return ctx->arityError(args[0].str());
+
+    Value const& command = args[1];
+
+    if (command == "create" && args.size() <= 4)
+    {
+      bool clone = args.size() > 2 && args[2] == "-clone";
+      if (args.size() == 4 && !clone)
+        return ctx->arityError(args[0].str());
+
+      std::string name;
+      if (args.size() > (clone ? 3u : 2u))
+        name = args.back().str();
+      else
+      {
+        for (size_t i = ctx->interps.size(); name.empty() || ctx->interps.count(name); ++i)
+          name = "interp" + std::to_string(i);
+      }
+
+      if (ctx->interps.count(name))
+        return ctx->reportError("Interpreter '" + name + "' already exists");
+
+      ctx->interps[name] = clone ? std::shared_ptr<Context>(ctx->clone()) : std::make_shared<Context>();
+      ctx->current().result = Value(name);
+      return RET_OK;
+    }
+
+    if (args.size() < 3)
+      return ctx->arityError(args[0].str());
+
+    InterpMap::iterator it = ctx->interps.find(args[2].str());
+    if (it == ctx->interps.end())
+      return ctx->reportError("Could not find interpreter '" + args[2].str() + "'");
+
+    if (command == "eval" && args.size() >= 4)
+    {
+      std::string code(args[3].view());
+      for (size_t i = 4; i < args.size(); ++i)
+      {
+        code += ' ';
+        code += args[i].view();
+      }
+
+      // Keep the child alive even if the script deletes it
+      std::shared_ptr<Context> child = it->second;
+      ReturnCode retCode = evaluateChild(ctx, child.get(), code);
+      if (failed(retCode))
+        return retCode;
+
+      ctx->current().result = child->current().result;
+      return RET_OK;
+    }
+    else if (command == "delete" && args.size() == 3)
+    {
+      ctx->interps.erase(it);
+      ctx->current().result = Value();
+      return RET_OK;
+    }
+
+    return ctx->reportError("Unknown or malformed subcommand '" + command.str() + "' to '" + args[0].str() + "'");
+  }
+
+  // -- Timing --
+
+  // time script ?count?, the script is compiled once and the mean time of a run reported
+  static ReturnCode builtInTime(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2 && args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    int64_t count = 1;
+    if (args.size() == 3 && !args[2].asInt(count))
+      return ctx->reportError("Expected an iteration count but got '" + args[2].str() + "'");
+
+    CompiledScriptPtr script = ctx->compile(args[1].str());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int64_t done = 0;
+
+    while (done < count)
+    {
+      ReturnCode retCode = ctx->tick();
+      if (retCode == RET_OK)
+        retCode = ctx->execute(*script);
+
+      ++done;
+      if (retCode == RET_BREAK)
+        break;
+      else if (retCode != RET_OK && retCode != RET_CONTINUE)
+        return retCode;
+    }
+
+    const double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    char buf[64];
+    snprintf(buf, 64, "%.10g microseconds per iteration", done > 0 ? elapsed / done : 0.0);
+    ctx->current().result = Value(buf);
+    return RET_OK;
+  }
+
+  // The time stamp counter where there is one, it is only good for differences on one machine
+  static int64_t readClicks()
+  {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return (int64_t)__rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+    return (int64_t)__builtin_ia32_rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  // clock seconds|milliseconds|microseconds, clock clicks ?-milliseconds|-microseconds?
+  static ReturnCode builtInClock(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2 && args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    Value const& command = args[1];
+    const std::chrono::system_clock::duration now = std::chrono::system_clock::now().time_since_epoch();
+
+    if (command == "clicks")
+    {
+      if (args.size() == 2)
+        ctx->current().result = Value::fromInt(readClicks());
+      else if (args[2] == "-microseconds")
+        ctx->current().result = Value::fromInt(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+      else if (args[2] == "-milliseconds")
+        ctx->current().result = Value::fromInt(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+      else
+        return ctx->reportError("Unknown option '" + args[2].str() + "' to 'clock clicks'");
+      return RET_OK;
+    }
+
+    if (args.size() != 2)
+      return ctx->arityError(args[0].str());
+
+    if (command == "seconds")
+      ctx->current().result = Value::fromInt(std::chrono::duration_cast<std::chrono::seconds>(now).count());
+    else if (command == "milliseconds")
+      ctx->current().result = Value::fromInt(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+    else if (command == "microseconds")
+      ctx->current().result = Value::fromInt(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    else
+      return ctx->reportError("Unknown or malformed subcommand '" + command.str() + "' to '" + args[0].str() + "'");
+
+    return RET_OK;
+  }
+
+  // -- Optimizer --
+
+  // Commands whose result only depends on their arguments, calls with literal arguments are
+  // computed once when the script is compiled
+  static bool isPure(ProcedureCallback callback)
+  {
+    return callback == builtInString || callback == builtInSplit || callback == builtInLindex || callback == builtInLlength;
+  }
+
+  static void assume(AssumptionList & assumptions, std::string const& name, ProcedureCallback callback)
+  {
+    std::pair<std::string, ProcedureCallback> assumption(name, callback);
+    if (std::find(assumptions.begin(), assumptions.end(), assumption) == assumptions.end())
+      assumptions.push_back(assumption);
+  }
+
+  static bool isLiteral(CompiledWord const& word)
+  {
+    return word.size() == 1 && word[0].type == PART_LITERAL;
+  }
+
+  static bool constantCondition(Context * ctx, std::string const& str, double & value)
+  {
+    CompiledExprPtr expr = compileExpression(ctx, str);
+    return expr && constantExpression(*expr, value);
+  }
+
+  // Replaces a command substitution by its result when it is a pure command on literals
+  static bool foldCommand(Context * ctx, AssumptionList & assumptions, CompiledScript const& script, Value & result)
+  {
+    if (script.commands.size() != 1)
+      return false;
+
+    std::vector<CompiledWord> const& words = script.commands[0].words;
+    for (size_t i = 0; i < words.size(); ++i)
+      if (!isLiteral(words[i]))
+        return false;
+
+    std::string const& name = words[0][0].value.str();
+    Procedure const* proc = ctx->findProc(name);
+    if (!proc)
+      return false;
+
+    if (proc->callback == builtInExpr)
+    {
+      std::string str;
+      for (size_t i = 1; i < words.size(); ++i)
+        str += words[i][0].value.str();
+
+      double value;
+      if (words.size() == 1 || !constantCondition(ctx, str, value))
+        return false;
+
+      result = Value::fromDouble(value);
+    }
+    else if (isPure(proc->callback))
+    {
+      ArgumentVector args(words.size());
+      for (size_t i = 0; i < words.size(); ++i)
+        args[i] = words[i][0].value;
+
+      // Errors are left for the script to raise when it runs
+      Value saved = ctx->current().result;
+      ReturnCode retCode = proc->callback(ctx, args, proc->data);
+      result = ctx->current().result;
+      ctx->current().result = saved;
+
+      if (retCode != RET_OK)
+        return false;
+    }
+    else
+      return false;
+
+    assume(assumptions, name, proc->callback);
+    return true;
+  }
+
+  static void mergeLiterals(CompiledWord & word)
+  {
+    for (size_t i = 1; i < word.size();)
+    {
+      if (word[i - 1].type == PART_LITERAL && word[i].type == PART_LITERAL)
+      {
+        word[i - 1].value = Value(word[i - 1].value.str() + word[i].value.str());
+        word.erase(word.begin() + i);
+      }
+      else
+        ++i;
+    }
+  }
+
+  // Returns whether the command is an 'if' on a constant condition, branch is left null when no branch is taken
+  static bool foldIf(Context * ctx, AssumptionList & assumptions, CompiledCommand const& command, CompiledScriptPtr & branch)
   {
-    if (args.size() != 2)
-      return ctx->arityError(args[0]);
-    return ctx->reportError(args[1]);
+    std::vector<CompiledWord> const& words = command.words;
+    if ((words.size() != 3 && words.size() != 5) || !isLiteral(words[0]) || !isLiteral(words[1]) || !isLiteral(words[2]) ||
+        (words.size() == 5 && !isLiteral(words[4])))
+      return false;
+
+    Procedure const* proc = ctx->findProc(words[0][0].value.str());
+    double value;
+    if (!proc || proc->callback != builtInIf || !constantCondition(ctx, words[1][0].value.str(), value))
+      return false;
+
+    if (value > 0.0)
+      branch = ctx->compile(words[2][0].value.str());
+    else if (words.size() == 5)
+      branch = ctx->compile(words[4][0].value.str());
+
+    assume(assumptions, words[0][0].value.str(), builtInIf);
+    return true;
   }
 
-  static ReturnCode builtInEval(Context * ctx, ArgumentVector const& args, void * data)
+  // The optimized script is copied from the plain one at its first change
+  static CompiledScript & ownScript(CompiledScriptPtr & script, CompiledScriptPtr const& plain)
   {
-    if (args.size() != 2)
-      return ctx->arityError(args[0]);
-
-    std::string str;
-    for (size_t i = 1; i < args.size(); ++i)
-      str += args[i] + " ";
-
-    return ctx->evaluate(str);
+    if (!script)
+    {
+      script = std::make_shared<CompiledScript>();
+      script->commands = plain->commands;
+    }
+    return *script;
   }
 
-  static ReturnCode builtInWhile(Context * ctx, ArgumentVector const& args, void * data)
+  // Constant expressions, pure commands on literals and the concatenations they leave behind are
+  // folded, and 'if' on a constant condition runs its branch directly. Substitutions inside loop
+  // bodies that fold are thereby computed once instead of on every iteration. Returns the
+  // script itself when there is nothing to fold.
+  static CompiledScriptPtr optimizeScript(Context * ctx, CompiledScriptPtr const& plain)
   {
-    if (args.size() != 3)
-      return ctx->arityError(args[0]);
-
-    const std::string check = "expr " + args[1];
+    std::string error = ctx->error;
+    CompiledScriptPtr script;
+    AssumptionList assumptions;
 
-    while (true)
+    for (size_t c = 0; c < plain->commands.size(); ++c)
     {
-      ReturnCode retCode = ctx->evaluate(check);
-      if (retCode != RET_OK)
-        return retCode;
+      std::vector<CompiledWord> const& words = plain->commands[c].words;
+      bool leavesResult = false;
 
-      if (std::atof(ctx->current().result.c_str()) > 0.0)
+      // Parts keep their positions until the literals of a changed word are merged
+      for (size_t w = 0; w < words.size(); ++w)
       {
-        retCode = ctx->evaluate(args[2]);
-        if (retCode == RET_OK || retCode == RET_CONTINUE)
-          continue;
-        else if (retCode == RET_BREAK)
-          return RET_OK;
-        else
-          return retCode;
+        bool changed = false;
+
+        for (size_t p = 0; p < words[w].size(); ++p)
+        {
+          CompiledPart const& part = words[w][p];
+          if (part.type != PART_COMMAND)
+            continue;
+
+          CompiledScriptPtr nested = optimizeScript(ctx, part.script);
+          for (size_t i = 0; i < nested->assumptions.size(); ++i)
+            assume(assumptions, nested->assumptions[i].first, nested->assumptions[i].second);
+
+          Value result;
+          leavesResult = foldCommand(ctx, assumptions, *nested, result);
+          if (!leavesResult && nested == part.script)
+            continue;
+
+          CompiledCommand & command = ownScript(script, plain).commands[c];
+          CompiledPart & target = command.words[w][p];
+          if (leavesResult)
+          {
+            target.type = PART_LITERAL;
+            target.value = result;
+            target.script.reset();
+            command.leftover = result;
+          }
+          else
+            target.script = nested;
+          changed = true;
+        }
+
+        if (changed)
+          mergeLiterals(script->commands[c].words[w]);
       }
-      else
+
+      CompiledScriptPtr branch;
+      if (foldIf(ctx, assumptions, script ? script->commands[c] : plain->commands[c], branch))
       {
-        return RET_OK;
+        CompiledCommand & command = ownScript(script, plain).commands[c];
+        command.folded = true;
+        command.branch = branch;
       }
-    }
-  }
-
-  static ReturnCode buildInRetCode(Context * ctx, ArgumentVector const& args, void * data)
-  {
-    if (args[0] == "break")
-      return RET_BREAK;
-    return RET_CONTINUE;
-  }
-
-  static ReturnCode builtInIncr(Context * ctx, ArgumentVector const& args, void * data)
-  {
-    if (args.size() != 2 && args.size() != 3)
-      return ctx->arityError(args[0]);
 
-    std::string var;
-    if (!ctx->current().get(args[1], var))
-      return ctx->reportError("Could not find variable '" + args[1] + "'");
+      if (script)
+      {
+        CompiledCommand & command = script->commands[c];
+        command.leavesResult = leavesResult;
+        command.tailReturn = command.tailReturn && command.words[1][0].type == PART_COMMAND;
+      }
+    }
 
-    int inc = 1;
-    int value = std::atoi(var.c_str());
+    ctx->error = error;
 
-    if (args.size() == 3)
-      inc = std::atoi(args[2].c_str());
+    // Every change adds an assumption, without one there is no copy and the plain script is kept
+    if (!script)
+      return plain;
 
-    char buf[32];
-    snprintf(buf, 32, "%d", value + inc);
-    ctx->current().set(args[1], std::string(buf));
-    ctx->current().result = std::string(buf);
-    return RET_OK;
+    script->assumptions.swap(assumptions);
+    script->original = plain;
+    return script;
   }
 
   // -- Context --
 
+  static std::atomic<uint64_t> procEpochs(0);
+
   Context::Context()
-    : debug(false)
+    : procEpoch(++procEpochs),
+      limitHandler(0),
+      limitData(0),
+      commandCount(0),
+      nextCheck(UINT64_MAX),
+      limitReached(false),
+      scriptBytes(0),
+      exprBytes(0),
+      debug(false)
   {
     frames.push_back(CallFrame());
     registerProc("puts", &builtInPuts);
@@ -531,17 +2328,50 @@ namespace tcl {
     registerProc("expr", &builtInExpr);
     registerProc("proc", &builtInProc);
     registerProc("return", &builtInReturn);
+    registerProc("tailcall", &builtInTailcall);
     registerProc("error", &builtInError);
     registerProc("eval", &builtInEval);
     registerProc("while", &builtInWhile);
+    registerProc("for", &builtInFor);
+    registerProc("foreach", &builtInForeach);
     registerProc("break", &buildInRetCode);
     registerProc("continue", &buildInRetCode);
     registerProc("incr", &builtInIncr);
+    registerProc("upvar", &builtInUpvar);
+    registerProc("global", &builtInGlobal);
+    registerProc("variable", &builtInVariable);
+    registerProc("mmap", &builtInMmap);
+    registerProc("string", &builtInString);
+    registerProc("split", &builtInSplit);
+    registerProc("lindex", &builtInLindex);
+    registerProc("llength", &builtInLlength);
+    registerProc("interp", &builtInInterp);
+    registerProc("memoize", &builtInMemoize);
+    registerProc("rename", &builtInRename);
+    registerProc("apply", &builtInApply);
+    registerProc("time", &builtInTime);
+    registerProc("clock", &builtInClock);
+    registerProc("binary", &builtInBinary);
+    registerProc("tsv::set", &builtInTsvSet);
+    registerProc("tsv::get", &builtInTsvGet);
+    registerProc("tsv::incr", &builtInTsvIncr);
+    registerProc("tsv::lappend", &builtInTsvLappend);
+    registerProc("tsv::exists", &builtInTsvExists);
+    registerProc("tsv::unset", &builtInTsvUnset);
+    registerProc("thread::create", &builtInThreadCreate);
+    registerProc("thread::send", &builtInThreadSend);
+    registerProc("thread::wait", &builtInThreadWait);
+    registerProc("thread::post", &builtInThreadPost);
+    registerProc("thread::receive", &builtInThreadReceive);
+    registerProc("thread::id", &builtInThreadId);
+    registerProc("thread::release", &builtInThreadRelease);
+    registerProc("vexpr", &builtInVexpr);
   }
 
   ReturnCode Context::reportError(std::string const& _error)
   {
     error = _error;
+    limitReached = false;
     return RET_ERROR;
   }
 
@@ -550,100 +2380,509 @@ namespace tcl {
     return reportError("Wrong number of arguments to procedure '" + command + "'");
   }
 
-  ReturnCode Context::evaluate(std::string const& code)
+  // -- Limits --
+
+  static const uint64_t LimitCheckInterval = 256;
+
+  void Context::setLimits(Limits const& _limits, LimitHandler handler, void * data)
   {
-    Parser parser(code);
+    limits = _limits;
+    limitHandler = handler;
+    limitData = data;
+    commandCount = 0;
+    nextCheck = 0;
+    limitReached = false;
+    nextSlice = std::chrono::steady_clock::now() + limits.slice;
+  }
 
-    current().result = "";
-    std::vector<std::string> args;
+  ReturnCode Context::checkLimits()
+  {
+    if (limits.commands && commandCount > limits.commands && !limitExceeded(LIMIT_COMMANDS))
+      return RET_LIMIT;
 
-    while (true)
+    const bool timed = limits.deadline != std::chrono::steady_clock::time_point::max() || limits.slice.count();
+    if (timed)
     {
-      Token previousToken = parser.token;
-      if (!parser.next())
-        return RET_ERROR;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
 
-      if (debug)
-        std::cout << "Token: " << tokenAsReadable[parser.token] << " = '" << parser.value << "'" << std::endl;
+      if (now >= limits.deadline && !limitExceeded(LIMIT_DEADLINE))
+        return RET_LIMIT;
 
-      std::string value = parser.value;
-      if (parser.token == Variable)
+      if (limits.slice.count() && now >= nextSlice)
       {
-        std::string var;
-        if (current().get(value, var))
-          current().result = value = var;
-        else
-          return reportError("Could not locate variable '" + value + "'");
+        if (!limitExceeded(LIMIT_SLICE))
+          return RET_LIMIT;
+        nextSlice = std::chrono::steady_clock::now() + limits.slice;
       }
-      else if (parser.token == Command)
+    }
+
+    if (limits.memory && memoryUsage() > limits.memory && !limitExceeded(LIMIT_MEMORY))
+      return RET_LIMIT;
+
+    // Without a clock or memory to watch the next check is simply where the count runs out
+    nextCheck = UINT64_MAX;
+    if (timed || limits.memory)
+      nextCheck = commandCount + LimitCheckInterval;
+    if (limits.commands)
+      nextCheck = std::min(nextCheck, std::max(limits.commands, commandCount) + 1);
+
+    return RET_OK;
+  }
+
+  ReturnCode Context::checkDepth()
+  {
+    if (limits.depth && frames.size() > limits.depth && !limitExceeded(LIMIT_DEPTH))
+      return RET_LIMIT;
+    return RET_OK;
+  }
+
+  bool Context::limitExceeded(LimitType type)
+  {
+    static const char * messages[] = {
+      "Command limit exceeded",
+      "Time limit exceeded",
+      "Call depth limit exceeded",
+      "Memory limit exceeded",
+      "Script interrupted"
+    };
+
+    if (limitHandler && limitHandler(this, type, limitData))
+      return true;
+
+    reportError(messages[type]);
+    limitReached = true;
+    return false;
+  }
+
+  // An estimate of what the variables of all frames and the compile caches hold, text owned by
+  // a mapping is not counted
+  size_t Context::memoryUsage() const
+  {
+    size_t total = scriptBytes + exprBytes;
+
+    for (CallFrameStack::const_iterator frame = frames.begin(); frame != frames.end(); ++frame)
+    {
+      for (VariableMap::const_iterator it = frame->variables.begin(); it != frame->variables.end(); ++it)
+        total += it->first.size() + it->second->value.memoryUsage();
+
+      total += frame->result.memoryUsage();
+    }
+
+    return total;
+  }
+
+  ReturnCode Context::evaluate(std::string const& code)
+  {
+    return evaluate(code, 0);
+  }
+
+  ReturnCode Context::evaluate(std::string const& code, ArgumentVector * tail)
+  {
+    CompiledScriptPtr script = compile(code);
+    return execute(*script, tail);
+  }
+
+  // An estimate of what a compiled script holds, scripts it refers to are cache entries of their own
+  static size_t compiledSize(CompiledScript const& script)
+  {
+    size_t total = sizeof(CompiledScript) + script.commands.size() * sizeof(CompiledCommand);
+
+    for (size_t c = 0; c < script.commands.size(); ++c)
+    {
+      std::vector<CompiledWord> const& words = script.commands[c].words;
+      for (size_t w = 0; w < words.size(); ++w)
+      {
+        total += sizeof(CompiledWord) + words[w].size() * sizeof(CompiledPart);
+        for (size_t p = 0; p < words[w].size(); ++p)
+          total += words[w][p].text.size() + words[w][p].value.memoryUsage();
+      }
+    }
+
+    if (script.original)
+      total += compiledSize(*script.original);
+
+    return total;
+  }
+
+  CompiledScriptPtr Context::compile(std::string const& code)
+  {
+    ScriptCache::iterator it = scripts.find(code);
+    if (it != scripts.end())
+      return it->second;
+
+    CompiledScriptPtr script = std::make_shared<CompiledScript>();
+    compileScript(this, code, *script);
+    script = optimizeScript(this, script);
+
+    const size_t budget = cacheBudget(MaxCachedScriptBytes);
+    const size_t size = code.size() + compiledSize(*script);
+    if (size > budget / MaxCachedScriptSlice)
+      return script;
+
+    if (scriptBytes + size > budget)
+    {
+      scripts.clear();
+      scriptBytes = 0;
+    }
+
+    if (scripts.insert(std::make_pair(code, script)).second)
+      scriptBytes += size;
+    return script;
+  }
+
+  ReturnCode Context::execute(CompiledScript const& optimized, ArgumentVector * tail)
+  {
+    current().result = Value();
+    ArgumentVector args;
+    CompiledScript const* running = &optimized;
+
+    for (size_t c = 0, count = optimized.commands.size(); c < count; ++c)
+    {
+      // The optimized and the original script have the same commands, so it can switch at any of them
+      if (running->checkedEpoch.load(std::memory_order_relaxed) != procEpoch && !running->assumptions.empty())
       {
-        if (!evaluate(parser.value))
-          return RET_ERROR;
+        size_t i = 0;
+        for (; i < running->assumptions.size(); ++i)
+        {
+          Procedure const* proc = findProc(running->assumptions[i].first);
+          if (!proc || proc->callback != running->assumptions[i].second)
+            break;
+        }
 
-        value = current().result;
+        if (i == running->assumptions.size())
+          running->checkedEpoch.store(procEpoch, std::memory_order_relaxed);
+        else
+          running = running->original.get();
       }
-      else if (parser.token == Separator)
+
+      CompiledScript const& script = *running;
+      CompiledCommand const& command = script.commands[c];
+
+      if (command.folded && !(tail && c + 1 == count))
       {
-        previousToken = parser.token;
+        if (!command.branch)
+          continue;
+
+        ReturnCode retCode = execute(*command.branch);
+        if (retCode != RET_OK)
+          return retCode;
         continue;
       }
 
-      if (parser.token == EndOfLine || parser.token == EndOfFile)
+      Procedure const* ret = command.tailReturn && frames.size() > 1 ? findProc("return") : 0;
+      if (ret && ret->callback == builtInReturn)
       {
-        if (debug)
+        ArgumentVector call;
+        ReturnCode retCode = execute(*command.words[1][0].script, &call);
+        if (failed(retCode))
+          return retCode;
+
+        if (!call.empty())
         {
-          std::cout << "Evaluating: ";
+          Procedure const* proc = findProc(call[0].str());
+          if (proc && proc->callback == builtInProcExec && proc->data == current().procedure)
+          {
+            tailCall.swap(call);
+            return RET_RETURN;
+          }
 
-          for (size_t i = 0; i < args.size(); ++i)
-            std::cout << args[i] << ",";
-          std::cout << std::endl;
+          ReturnCode retCode = invoke(call);
+          if (failed(retCode))
+            return retCode;
+          if (!flushTailCall(this))
+            return failure();
         }
 
-        if (args.size() >= 1)
-        {
-          ProcedureMap::iterator it = procedures.find(args[0]);
-          if (it == procedures.end())
-            return reportError("Could not find procedure '" + args[0] + "'");
+        return RET_RETURN;
+      }
 
-          Procedure & proc = it->second;
+      args.resize(command.words.size());
+      for (size_t i = 0, len = command.words.size(); i < len; ++i)
+        if (!substitute(this, command.words[i], args[i]))
+          return failure();
 
-          ReturnCode retCode = proc.callback(this, args, proc.data);
-          if (retCode != RET_OK)
-            return retCode;
-        }
+      if (command.leavesResult)
+        current().result = command.leftover;
+
+      if (debug)
+      {
+        std::cout << "Evaluating: ";
 
-        args.clear();
+        for (size_t i = 0; i < args.size(); ++i)
+          std::cout << args[i].str() << ",";
+        std::cout << std::endl;
+      }
+
+      if (tail && c + 1 == count)
+      {
+        tail->swap(args);
+        break;
       }
 
-      if (!value.empty())
+      ReturnCode retCode = invoke(args);
+      if (retCode != RET_OK)
+        return retCode;
+    }
+
+    return RET_OK;
+  }
+
+  ReturnCode Context::invoke(ArgumentVector const& args)
+  {
+    if (tick() != RET_OK)
+      return RET_LIMIT;
+
+    Procedure const* proc = findProc(args[0].str());
+    if (!proc)
+      return reportError("Could not find procedure '" + args[0].str() + "'");
+
+    if (!proc->owner)
+      return proc->callback(this, args, proc->data);
+
+    // The procedure may be renamed or redefined while it runs
+    std::shared_ptr<void> definition = proc->owner;
+    return proc->callback(this, args, proc->data);
+  }
+
+  bool Context::registerProc(std::string const& name, ProcedureCallback proc, void * data)
+  {
+    if (findProc(name))
+      return reportError("Procedure '" + name + "' already exists!");
+
+    procedures.insert(std::make_pair(name, Procedure(proc, data)));
+    procEpoch = ++procEpochs;
+    return true;
+  }
+
+  Procedure const* Context::findProc(std::string const& name) const
+  {
+    ProcedureMap::const_iterator it = procedures.find(name);
+    Procedure const* proc = 0;
+
+    if (it != procedures.end())
+      proc = &it->second;
+    else if (sharedProcedures)
+      proc = sharedProcedures->find(name);
+
+    return proc && proc->callback ? proc : 0;
+  }
+
+  void Context::replaceProc(std::string const& name, Procedure const& proc)
+  {
+    procedures.insert_or_assign(name, proc);
+    procEpoch = ++procEpochs;
+  }
+
+  bool Context::renameProc(std::string const& from, std::string const& to)
+  {
+    Procedure const* proc = findProc(from);
+    if (!proc)
+      return reportError("Could not find procedure '" + from + "'");
+
+    if (!to.empty() && findProc(to))
+      return reportError("Procedure '" + to + "' already exists!");
+
+    Procedure renamed = *proc;
+
+    // A shared layer can not be changed, the name is hidden from it instead
+    if (sharedProcedures && sharedProcedures->find(from))
+      procedures.insert_or_assign(from, Procedure(0, 0));
+    else
+      procedures.erase(from);
+
+    if (!to.empty())
+      procedures.insert_or_assign(to, renamed);
+
+    procEpoch = ++procEpochs;
+    return true;
+  }
+
+  // -- Cloning --
+
+  // Moves what this context owns into layers that are frozen from now on, so a clone can
+  // point at them. Later writes land in fresh maps on top of the layers.
+  void Context::share()
+  {
+    if (!procedures.empty())
+    {
+      for (ProcedureMap::iterator it = procedures.begin(); it != procedures.end(); ++it)
+        if (it->second.callback == builtInProcExec)
+          static_cast<ProcData *>(it->second.data)->shared = true;
+
+      std::shared_ptr<ProcedureLayer> layer = std::make_shared<ProcedureLayer>();
+      layer->entries.swap(procedures);
+      layer->attach(sharedProcedures);
+      sharedProcedures = layer;
+    }
+
+    CallFrame & globals = frames.front();
+    if (!globals.variables.empty())
+    {
+      std::shared_ptr<VariableLayer> layer = std::make_shared<VariableLayer>();
+
+      // A slot held elsewhere, by a running foreach or an upvar link, still takes writes. It stays
+      // with this context and only a copy of its value is frozen.
+      for (VariableMap::iterator it = globals.variables.begin(); it != globals.variables.end(); )
       {
-        if (previousToken == Separator || previousToken == EndOfLine)
+        if (it->second.use_count() > 1)
         {
-          args.push_back(value);
+          layer->entries.insert(std::make_pair(it->first, makeVariable(it->second->value)));
+          ++it;
         }
         else
         {
-          if (args.empty())
-            args.push_back(value);
-          else
-            args.back() += value;
+          layer->entries.insert(layer->entries.end(), std::move(*it));
+          it = globals.variables.erase(it);
         }
       }
 
-      if (parser.token == EndOfFile)
-        break;
+      layer->attach(globals.inherited);
+      globals.inherited = layer;
     }
+  }
 
-    return RET_OK;
+  Context::Context(Context const* parent)
+    : sharedProcedures(parent->sharedProcedures),
+      procEpoch(++procEpochs),
+      limitHandler(0),
+      limitData(0),
+      commandCount(0),
+      nextCheck(UINT64_MAX),
+      limitReached(false),
+      scriptBytes(0),
+      exprBytes(0),
+      debug(parent->debug)
+  {
+    frames.push_back(CallFrame());
+    frames.front().inherited = parent->frames.front().inherited;
   }
 
-  bool Context::registerProc(std::string const& name, ProcedureCallback proc, void * data)
+  std::unique_ptr<Context> Context::clone()
   {
-    if (procedures.find(name) != procedures.end())
-      return reportError("Procedure '" + name + "' already exists!");
+    share();
+    return std::unique_ptr<Context>(new Context(this));
+  }
 
-    procedures.insert(std::make_pair(name, Procedure(proc, data)));
+  // -- Typed procedures --
+
+  bool convertInt(Context * ctx, Value const& arg, int64_t & out)
+  {
+    if (arg.asInt(out))
+      return true;
+
+    // Accept integral doubles, expr results are doubles
+    double d;
+    if (arg.asDouble(d) && d == std::floor(d) && std::fabs(d) < 9.2e18)
+    {
+      out = (int64_t)d;
+      return true;
+    }
+
+    ctx->reportError("Expected integer but got '" + arg.str() + "'");
+    return false;
+  }
+
+  bool convertDouble(Context * ctx, Value const& arg, double & out)
+  {
+    if (arg.asDouble(out))
+      return true;
+
+    ctx->reportError("Expected number but got '" + arg.str() + "'");
+    return false;
+  }
+
+  bool convertBool(Context * ctx, Value const& arg, bool & out)
+  {
+    if (arg == "1" || arg == "true" || arg == "yes" || arg == "on")
+      out = true;
+    else if (arg == "0" || arg == "false" || arg == "no" || arg == "off")
+      out = false;
+    else
+    {
+      double d;
+      if (!arg.asDouble(d))
+        return ctx->reportError("Expected boolean but got '" + arg.str() + "'");
+      out = d != 0.0;
+    }
+
+    return true;
+  }
+
+  void storeInt(Context * ctx, int64_t value)
+  {
+    ctx->current().result.setInt(value);
+  }
+
+  void storeDouble(Context * ctx, double value)
+  {
+    ctx->current().result.setDouble(value);
+  }
+
+  void storeBool(Context * ctx, bool value)
+  {
+    ctx->current().result.setInt(value ? 1 : 0);
+  }
+
+  void storeString(Context * ctx, Value const& value)
+  {
+    ctx->current().result = value;
+  }
+
+  // -- Script --
+
+  Script::Script(Context & ctx, std::string const& code)
+    : ctx(&ctx),
+      script(ctx.compile(code))
+  { }
+
+  size_t Script::parameter(std::string const& name)
+  {
+    VariableMap::iterator it = variables.find(name);
+    if (it != variables.end())
+      for (size_t i = 0; i < slots.size(); ++i)
+        if (slots[i] == it->second)
+          return i;
+
+    slots.push_back(makeVariable(""));
+    variables[name] = slots.back();
+    return slots.size() - 1;
+  }
+
+  bool Script::bindValue(size_t index, Value const& value)
+  {
+    if (index >= slots.size())
+      return ctx->reportError("Script has no parameter " + std::to_string(index));
+
+    slots[index]->value = value;
     return true;
   }
 
-}
\ No newline at end of file
+  ReturnCode Script::run(Value & result)
+  {
+    ctx->frames.push_back(CallFrame());
+    ctx->current().variables.swap(variables);
+
+    ReturnCode retCode = ctx->execute(*script);
+    if (retCode == RET_RETURN && !flushTailCall(ctx))
+      retCode = RET_ERROR;
+
+    result = std::move(ctx->current().result);
+
+    // Only the parameters survive between runs
+    variables.swap(ctx->current().variables);
+    if (variables.size() != slots.size())
+    {
+      for (VariableMap::iterator it = variables.begin(); it != variables.end(); )
+      {
+        if (std::find(slots.begin(), slots.end(), it->second) == slots.end())
+          variables.erase(it++);
+        else
+          ++it;
+      }
+    }
+
+    ctx->frames.pop_back();
+    return retCode == RET_RETURN ? RET_OK : retCode;
+  }
+
+}
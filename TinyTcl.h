@@ -4,11 +4,23 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <chrono>
+#include <future>
+#include <stdint.h>
 
 namespace tcl {
 
   struct Context;
   struct CallFrame;
+  struct CompiledScript;
+  struct CompiledExpr;
 
   enum ReturnCode
   {
@@ -16,75 +28,610 @@ namespace tcl {
     RET_OK,
     RET_RETURN,
     RET_BREAK,
-    RET_CONTINUE
+    RET_CONTINUE,
+    RET_LIMIT
   };
 
-  typedef std::vector<std::string> ArgumentVector;
+  // Both abort the script, a limit is not an error of the script itself
+  inline bool failed(ReturnCode code) { return code == RET_ERROR || code == RET_LIMIT; }
+
+  // Numbers packed in one array, either all of them integers or all doubles
+  struct NumberArray
+  {
+    NumberArray()
+      : isInt(true)
+    { }
+
+    size_t size() const { return isInt ? ints.size() : doubles.size(); }
+    double at(size_t i) const { return isInt ? (double)ints[i] : doubles[i]; }
+
+    bool isInt;
+    std::vector<int64_t> ints;
+    std::vector<double> doubles;
+  };
+
+  typedef std::shared_ptr<NumberArray const> NumberArrayPtr;
+
+  // A reference counted string that caches its numeric interpretation. Copies share the
+  // same representation, so passing a Value around never duplicates the text. Numbers
+  // stored with setInt/setDouble are only rendered when the string is asked for.
+  // The text may also live in memory owned by someone else (a mapped file), slices of
+  // such a value keep the owner alive instead of copying. Lists of numbers can be kept packed,
+  // they are rendered like any other list when their text is needed.
+  struct Value
+  {
+    Value()
+    { }
+
+    Value(std::string const& str);
+    Value(std::string && str);
+    Value(const char * str);
+
+    static Value fromInt(int64_t value);
+    static Value fromDouble(double value);
+    static Value fromExternal(std::shared_ptr<void const> const& owner, std::string_view text);
+    static Value fromList(std::vector<Value> && elements);
+    static Value fromNumbers(NumberArrayPtr const& numbers);
+
+    std::string const& str() const;
+    std::string_view view() const;
+    bool empty() const;
+    size_t memoryUsage() const;
+
+    bool asInt(int64_t & out) const;
+    bool asDouble(double & out) const;
+    std::vector<Value> const& asList() const;
+    NumberArrayPtr asNumbers() const;
+
+    Value slice(size_t offset, size_t length) const;
+
+    // Something derived from the text, like a compiled lambda, kept with the representation until
+    // the value is changed. The type tells apart what different commands cache.
+    std::shared_ptr<void> cached(void const* type) const;
+    void cache(void const* type, std::shared_ptr<void> const& data) const;
+
+    // A value with a representation of its own over text nobody can change any more, it
+    // can be handed to another thread while this one keeps being used here
+    Value detach() const;
+
+    void set(std::string const& str);
+    void set(std::string && str);
+    void setInt(int64_t value);
+    void setDouble(double value);
+
+    bool operator==(Value const& other) const { return rep == other.rep || view() == other.view(); }
+    bool operator==(const char * other) const { return view() == other; }
+    bool operator!=(const char * other) const { return view() != other; }
+
+  private:
+    enum Numeric
+    {
+      NUM_UNKNOWN,
+      NUM_NONE,
+      NUM_INT,
+      NUM_DOUBLE
+    };
+
+    struct Rep
+    {
+      Rep()
+        : stringValid(true),
+          numeric(NUM_UNKNOWN),
+          intValue(0),
+          doubleValue(0.0),
+          cachedType(0)
+      { }
+
+      std::string string;
+      bool stringValid;
+      unsigned char numeric;
+      int64_t intValue;
+      double doubleValue;
+
+      std::shared_ptr<void const> owner;
+      std::string_view external;
+      std::shared_ptr<std::vector<Value> > list;
+      NumberArrayPtr numbers;
+
+      void const* cachedType;
+      std::shared_ptr<void> cachedData;
+    };
+
+    Rep * unique();
+    void parse() const;
+
+    std::shared_ptr<Rep> rep;
+  };
+
+  typedef std::vector<Value> ArgumentVector;
   typedef ReturnCode (*ProcedureCallback)(Context * ctx, ArgumentVector const& args, void * data);
 
-  typedef std::map<std::string, std::string> VariableMap;
+  struct Variable
+  {
+    Variable(Value const& value)
+      : value(value)
+    { }
+
+    Value value;
+  };
+
+  // Frames linked by upvar/global share the same slot, so a lookup through a link is a plain lookup
+  typedef std::shared_ptr<Variable> VariablePtr;
+  typedef std::map<std::string, VariablePtr> VariableMap;
+
+  inline VariablePtr makeVariable(Value const& value)
+  {
+    return std::make_shared<Variable>(value);
+  }
+
+  // Entries shared between cloned contexts. A layer is never modified once it is shared,
+  // lookups that miss the entries a context owns fall through the chain of layers. Repeated
+  // cloning would grow the chain without end, so past MaxSharedLayers it is merged into the
+  // newest layer, which then stands alone.
+  static const size_t MaxSharedLayers = 8;
+
+  template <typename T>
+  struct SharedLayer
+  {
+    SharedLayer()
+      : depth(1)
+    { }
+
+    // Puts this layer, not shared yet, on top of another
+    void attach(std::shared_ptr<SharedLayer const> const& below)
+    {
+      parent = below;
+      depth = below ? below->depth + 1 : 1;
+      if (depth <= MaxSharedLayers)
+        return;
+
+      // Entries already here hide those of the same name below
+      for (SharedLayer const* layer = below.get(); layer; layer = layer->parent.get())
+        entries.insert(layer->entries.begin(), layer->entries.end());
+
+      parent.reset();
+      depth = 1;
+    }
+
+    T const* find(std::string const& name) const
+    {
+      for (SharedLayer const* layer = this; layer; layer = layer->parent.get())
+      {
+        typename std::map<std::string, T>::const_iterator it = layer->entries.find(name);
+        if (it != layer->entries.end())
+          return &it->second;
+      }
+      return 0;
+    }
+
+    std::map<std::string, T> entries;
+    std::shared_ptr<SharedLayer const> parent;
+    size_t depth;
+  };
+
+  typedef SharedLayer<VariablePtr> VariableLayer;
+  typedef std::shared_ptr<VariableLayer const> VariableLayerPtr;
 
   struct CallFrame
   {
     CallFrame()
-      : result("")
+      : procedure(0)
     { }
 
-    void set(std::string const& name, std::string const& value)
+    void set(std::string const& name, Value const& value)
     {
-      variables[name] = value;
+      VariableMap::iterator it = variables.find(name);
+      if (it == variables.end())
+        variables.insert(std::make_pair(name, makeVariable(value)));
+      else
+        it->second->value = value;
     }
 
-    std::string get(std::string const& name)
+    Value const* get(std::string const& name) const
     {
       VariableMap::const_iterator result = variables.find(name);
-      return result == variables.end() ? "" : result->second;
+      if (result != variables.end())
+        return &result->second->value;
+
+      VariablePtr const* var = inherited ? inherited->find(name) : 0;
+      return var ? &(*var)->value : 0;
     }
 
-    bool get(std::string const& name, std::string & value) const
+    // Returns the value of an existing variable for writing, or null
+    Value * find(std::string const& name)
     {
-      VariableMap::const_iterator result = variables.find(name);
-      if (result == variables.end())
-        return false;
-      value = result->second;
-      return true;
+      VariableMap::iterator result = variables.find(name);
+      if (result != variables.end())
+        return &result->second->value;
+
+      return inherited && inherited->find(name) ? &slot(name)->value : 0;
+    }
+
+    VariablePtr & slot(std::string const& name)
+    {
+      VariablePtr & var = variables[name];
+      if (!var)
+      {
+        // A variable shared with a clone is copied before anyone can write to it
+        VariablePtr const* shared = inherited ? inherited->find(name) : 0;
+        var = makeVariable(shared ? (*shared)->value : Value());
+      }
+      return var;
+    }
+
+    void link(std::string const& name, VariablePtr const& var)
+    {
+      variables[name] = var;
     }
 
     VariableMap variables;
-    std::string result;
+    VariableLayerPtr inherited;
+    Value result;
+
+    // Data of the script procedure running in this frame, a tail call only reuses the frame for that one
+    void * procedure;
   };
 
+  // A null callback marks a procedure deleted while a shared layer below still has it.
+  // Owner keeps the data alive for as long as the procedure, or one of its running calls, does.
   struct Procedure
   {
-    Procedure(ProcedureCallback callback, void * data)
+    Procedure(ProcedureCallback callback, void * data, std::shared_ptr<void> const& owner = std::shared_ptr<void>())
       : callback(callback),
-        data(data)
+        data(data),
+        owner(owner)
     { }
 
     ProcedureCallback callback;
     void * data;
+    std::shared_ptr<void> owner;
   };
 
   typedef std::map<std::string, Procedure> ProcedureMap;
-  typedef std::vector<CallFrame> CallFrameVector;
+  typedef SharedLayer<Procedure> ProcedureLayer;
+  typedef std::shared_ptr<ProcedureLayer const> ProcedureLayerPtr;
+  typedef std::map<std::string, std::shared_ptr<Context> > InterpMap;
+  typedef std::deque<CallFrame> CallFrameStack;
+  typedef std::shared_ptr<CompiledScript> CompiledScriptPtr;
+  typedef std::unordered_map<std::string, CompiledScriptPtr> ScriptCache;
+  typedef std::shared_ptr<CompiledExpr> CompiledExprPtr;
+  typedef std::unordered_map<std::string, CompiledExprPtr> ExprCache;
+
+  enum LimitType
+  {
+    LIMIT_COMMANDS,
+    LIMIT_DEADLINE,
+    LIMIT_DEPTH,
+    LIMIT_MEMORY,
+    LIMIT_SLICE
+  };
+
+  // Budgets a context runs under, zero (or no deadline) means unlimited. When one is used up
+  // the handler may raise it and continue, otherwise the script is aborted with RET_LIMIT.
+  // A time slice calls the handler periodically, giving the host a point to yield at.
+  // The call depth is the exception to unlimited defaults: every level of script recursion that
+  // is not a tail call is native recursion too, so it starts at DefaultDepthLimit. Setting it to
+  // zero lifts the limit and leaves the native stack to the host.
+  static const size_t DefaultDepthLimit = 1000;
+
+  struct Limits
+  {
+    Limits()
+      : commands(0),
+        deadline(std::chrono::steady_clock::time_point::max()),
+        depth(DefaultDepthLimit),
+        memory(0),
+        slice(0)
+    { }
+
+    uint64_t commands;
+    std::chrono::steady_clock::time_point deadline;
+    size_t depth;
+    size_t memory;
+    std::chrono::microseconds slice;
+  };
+
+  // Returns true to keep running, typically after raising the exhausted limit
+  typedef bool (*LimitHandler)(Context * ctx, LimitType type, void * data);
 
   struct Context
   {
     Context();
 
     ReturnCode evaluate(std::string const& code);
+    // Evaluates code but leaves the last command undispatched, its arguments are stored in tail.
+    ReturnCode evaluate(std::string const& code, ArgumentVector * tail);
+    ReturnCode invoke(ArgumentVector const& args);
+
+    CompiledScriptPtr compile(std::string const& code);
+    ReturnCode execute(CompiledScript const& script, ArgumentVector * tail = 0);
+
     bool registerProc(std::string const& name, ProcedureCallback proc, void * data = 0);
+    Procedure const* findProc(std::string const& name) const;
+
+    // Defines or redefines a procedure, calls of the old definition still running finish with it
+    void replaceProc(std::string const& name, Procedure const& proc);
+    // An empty new name deletes the procedure
+    bool renameProc(std::string const& from, std::string const& to);
+
+    // Creates a context sharing the procedures and globals of this one, whatever either side
+    // changes afterwards is copied into its own entries and stays invisible to the other
+    std::unique_ptr<Context> clone();
+
+    // Registers a plain C++ function, arity checks and argument conversions are generated at compile time
+    template <typename R, typename... A>
+    bool registerProc(std::string const& name, R (*proc)(A...));
 
     ReturnCode arityError(std::string const& command);
     ReturnCode reportError(std::string const& _error);
 
+    // Replaces the limits and restarts the command count and time slice
+    void setLimits(Limits const& _limits, LimitHandler handler = 0, void * data = 0);
+
+    // Counts a command against the limits, called at dispatch and at loop back edges.
+    // Only every few hundred commands the clock and memory are looked at.
+    ReturnCode tick() { return ++commandCount < nextCheck ? RET_OK : checkLimits(); }
+    ReturnCode checkLimits();
+    ReturnCode checkDepth();
+    bool limitExceeded(LimitType type);
+    size_t memoryUsage() const;
+
+    // What a failure reported through a bool turns into
+    ReturnCode failure() const { return limitReached ? RET_LIMIT : RET_ERROR; }
+
     CallFrame & current() { return frames.back(); }
 
     ProcedureMap procedures;
-    CallFrameVector frames;
+    ProcedureLayerPtr sharedProcedures;
+    // Changes whenever a procedure is added, renamed or replaced, optimized scripts check it
+    uint64_t procEpoch;
+    CallFrameStack frames;
+    ArgumentVector tailCall;
+    ScriptCache scripts;
+    ExprCache exprs;
+
+    Limits limits;
+    LimitHandler limitHandler;
+    void * limitData;
+    uint64_t commandCount;
+    uint64_t nextCheck;
+    std::chrono::steady_clock::time_point nextSlice;
+    bool limitReached;
+
+    // What the caches above hold, counted by memoryUsage. They keep to a quarter of the memory
+    // limit, so caching alone never uses it up.
+    size_t scriptBytes;
+    size_t exprBytes;
+    size_t cacheBudget(size_t most) const { return limits.memory && limits.memory / 4 < most ? limits.memory / 4 : most; }
+
+    InterpMap interps;
 
     std::string error;
     bool debug;
+
+  private:
+    explicit Context(Context const* parent);
+    void share();
+  };
+
+  // Opening minus closing braces and brackets, tells a prompt whether the code typed so far is complete
+  int bracketBalance(std::string_view code);
+
+  // -- Threads --
+
+  // Interpreters running on threads of their own, addressed by id. Scripts and values reach them
+  // through bounded lock-free mailboxes, values are detached rather than turned into script text.
+  struct ThreadResult
+  {
+    ThreadResult()
+      : code(RET_OK)
+    { }
+
+    ReturnCode code;
+    Value result;
+    std::string error;
+  };
+
+  std::string createThread(std::string const& script = std::string());
+  bool sendScript(std::string const& id, std::string const& script, std::future<ThreadResult> & reply);
+  bool postValue(std::string const& id, Value const& value);
+  bool releaseThread(std::string const& id);
+
+  // -- Typed procedures --
+
+  bool convertInt(Context * ctx, Value const& arg, int64_t & out);
+  bool convertDouble(Context * ctx, Value const& arg, double & out);
+  bool convertBool(Context * ctx, Value const& arg, bool & out);
+
+  void storeInt(Context * ctx, int64_t value);
+  void storeDouble(Context * ctx, double value);
+  void storeBool(Context * ctx, bool value);
+  void storeString(Context * ctx, Value const& value);
+
+  template <typename T, typename Enable = void>
+  struct TypedValue;
+
+  template <typename T>
+  struct TypedValue<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+  {
+    bool convert(Context * ctx, Value const& arg)
+    {
+      int64_t result;
+      if (!convertInt(ctx, arg, result))
+        return false;
+
+      value = static_cast<T>(result);
+      if (static_cast<int64_t>(value) != result)
+      {
+        ctx->reportError("Integer '" + arg.str() + "' is out of range");
+        return false;
+      }
+
+      return true;
+    }
+
+    T get() const { return value; }
+    static void store(Context * ctx, T value) { storeInt(ctx, static_cast<int64_t>(value)); }
+    static Value toValue(T value) { return Value::fromInt(static_cast<int64_t>(value)); }
+
+    T value;
+  };
+
+  template <typename T>
+  struct TypedValue<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+  {
+    bool convert(Context * ctx, Value const& arg)
+    {
+      double result;
+      if (!convertDouble(ctx, arg, result))
+        return false;
+
+      value = static_cast<T>(result);
+      return true;
+    }
+
+    T get() const { return value; }
+    static void store(Context * ctx, T value) { storeDouble(ctx, static_cast<double>(value)); }
+    static Value toValue(T value) { return Value::fromDouble(static_cast<double>(value)); }
+
+    T value;
+  };
+
+  template <>
+  struct TypedValue<bool>
+  {
+    bool convert(Context * ctx, Value const& arg) { return convertBool(ctx, arg, value); }
+    bool get() const { return value; }
+    static void store(Context * ctx, bool value) { storeBool(ctx, value); }
+    static Value toValue(bool value) { return Value::fromInt(value ? 1 : 0); }
+
+    bool value;
+  };
+
+  template <>
+  struct TypedValue<std::string>
+  {
+    bool convert(Context * ctx, Value const& arg) { value = &arg.str(); return true; }
+    std::string const& get() const { return *value; }
+    static void store(Context * ctx, std::string value) { storeString(ctx, std::move(value)); }
+    static Value toValue(std::string const& value) { return Value(value); }
+
+    std::string const* value;
+  };
+
+  template <>
+  struct TypedValue<std::string_view>
+  {
+    bool convert(Context * ctx, Value const& arg) { value = arg.view(); return true; }
+    std::string_view get() const { return value; }
+    static void store(Context * ctx, std::string_view value) { storeString(ctx, std::string(value)); }
+    static Value toValue(std::string_view value) { return Value(std::string(value)); }
+
+    std::string_view value;
+  };
+
+  template <>
+  struct TypedValue<const char *>
+  {
+    bool convert(Context * ctx, Value const& arg) { value = arg.str().c_str(); return true; }
+    const char * get() const { return value; }
+    static void store(Context * ctx, const char * value) { storeString(ctx, Value(value ? value : "")); }
+    static Value toValue(const char * value) { return Value(value ? value : ""); }
+
+    const char * value;
+  };
+
+  template <>
+  struct TypedValue<Value>
+  {
+    bool convert(Context * ctx, Value const& arg) { value = arg; return true; }
+    Value const& get() const { return value; }
+    static void store(Context * ctx, Value const& value) { storeString(ctx, value); }
+    static Value toValue(Value const& value) { return value; }
+
+    Value value;
+  };
+
+  template <typename R>
+  struct TypedCall
+  {
+    template <typename F, typename... V>
+    static ReturnCode call(Context * ctx, F proc, V const&... values)
+    {
+      TypedValue<typename std::decay<R>::type>::store(ctx, proc(values.get()...));
+      return RET_OK;
+    }
+  };
+
+  template <>
+  struct TypedCall<void>
+  {
+    template <typename F, typename... V>
+    static ReturnCode call(Context * ctx, F proc, V const&... values)
+    {
+      proc(values.get()...);
+      storeString(ctx, Value());
+      return RET_OK;
+    }
+  };
+
+  template <typename R, typename... A>
+  struct TypedProcedure
+  {
+    typedef R (*Function)(A...);
+
+    static ReturnCode callback(Context * ctx, ArgumentVector const& args, void * data)
+    {
+      if (args.size() != sizeof...(A) + 1)
+        return ctx->arityError(args[0].str());
+
+      return dispatch(ctx, args, reinterpret_cast<Function>(data), std::index_sequence_for<A...>());
+    }
+
+    template <size_t... I>
+    static ReturnCode dispatch(Context * ctx, ArgumentVector const& args, Function proc, std::index_sequence<I...>)
+    {
+      std::tuple<TypedValue<typename std::decay<A>::type>...> values;
+
+      if (!(std::get<I>(values).convert(ctx, args[I + 1]) && ...))
+        return RET_ERROR;
+
+      return TypedCall<R>::call(ctx, proc, std::get<I>(values)...);
+    }
+  };
+
+  template <typename R, typename... A>
+  bool Context::registerProc(std::string const& name, R (*proc)(A...))
+  {
+    return registerProc(name, &TypedProcedure<R, A...>::callback, reinterpret_cast<void *>(proc));
+  }
+
+  // A script that is compiled once and run many times, like a prepared statement.
+  // Parameters are variables of the frame the script runs in, the host binds them
+  // to typed values before each run instead of splicing them into the source.
+  struct Script
+  {
+    Script(Context & ctx, std::string const& code);
+
+    size_t parameter(std::string const& name);
+
+    // Values are converted the way typed procedures return them, an unknown position is an error
+    template <typename T>
+    bool bind(size_t index, T const& value) { return bindValue(index, TypedValue<typename std::decay<T>::type>::toValue(value)); }
+    bool bind(size_t index, const char * value) { return bindValue(index, TypedValue<const char *>::toValue(value)); }
+
+    template <typename T>
+    bool bind(std::string const& name, T const& value) { return bind(parameter(name), value); }
+    bool bind(std::string const& name, const char * value) { return bind(parameter(name), value); }
+
+    bool bindValue(size_t index, Value const& value);
+
+    ReturnCode run(Value & result);
+
+    Context * ctx;
+    CompiledScriptPtr script;
+    std::vector<VariablePtr> slots;
+    VariableMap variables;
   };
 
 }
\ No newline at end of file
@@ -0,0 +1,479 @@
+
+#include "TinyTcl.h"
+
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+
+namespace tcl {
+
+  // -- Epochs --
+
+  // Readers announce the epoch they entered in. Whatever a writer replaces is retired with the
+  // current epoch and only freed once every reader that could still see it has left.
+
+  static const uint64_t EpochIdle = UINT64_MAX;
+  static const size_t ReclaimThreshold = 64;
+
+  struct EpochRecord
+  {
+    EpochRecord()
+      : epoch(EpochIdle),
+        used(true),
+        next(0)
+    { }
+
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> used;
+    EpochRecord * next;
+  };
+
+  struct Retired
+  {
+    void * pointer;
+    void (*destroy)(void * pointer);
+    uint64_t epoch;
+  };
+
+  static std::atomic<uint64_t> globalEpoch(1);
+  static std::atomic<EpochRecord *> epochRecords(0);
+
+  // Retired memory of threads that exited before it could be freed
+  static std::mutex orphansLock;
+  static std::vector<Retired> orphans;
+
+  // Records are never freed, a thread that exits leaves its record for the next one
+  static EpochRecord * acquireRecord()
+  {
+    for (EpochRecord * record = epochRecords.load(); record; record = record->next)
+    {
+      bool expected = false;
+      if (!record->used.load() && record->used.compare_exchange_strong(expected, true))
+        return record;
+    }
+
+    EpochRecord * record = new EpochRecord;
+    record->next = epochRecords.load();
+    while (!epochRecords.compare_exchange_weak(record->next, record))
+      ;
+    return record;
+  }
+
+  static uint64_t oldestActiveEpoch()
+  {
+    uint64_t oldest = EpochIdle;
+    for (EpochRecord * record = epochRecords.load(); record; record = record->next)
+      oldest = std::min(oldest, record->epoch.load());
+    return oldest;
+  }
+
+  // Frees what no reader can see any more, keeps the rest
+  static void freeRetired(std::vector<Retired> & retired, uint64_t oldest)
+  {
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); ++i)
+    {
+      if (retired[i].epoch < oldest)
+        retired[i].destroy(retired[i].pointer);
+      else
+        retired[kept++] = retired[i];
+    }
+    retired.resize(kept);
+  }
+
+  struct EpochThread
+  {
+    EpochThread()
+      : record(acquireRecord()),
+        depth(0)
+    { }
+
+    ~EpochThread()
+    {
+      reclaim();
+      record->epoch.store(EpochIdle);
+      record->used.store(false);
+
+      if (!retired.empty())
+      {
+        std::lock_guard<std::mutex> lock(orphansLock);
+        orphans.insert(orphans.end(), retired.begin(), retired.end());
+      }
+    }
+
+    void reclaim()
+    {
+      globalEpoch.fetch_add(1);
+      const uint64_t oldest = oldestActiveEpoch();
+
+      freeRetired(retired, oldest);
+
+      std::unique_lock<std::mutex> lock(orphansLock, std::try_to_lock);
+      if (lock.owns_lock())
+        freeRetired(orphans, oldest);
+    }
+
+    EpochRecord * record;
+    unsigned depth;
+    std::vector<Retired> retired;
+  };
+
+  static thread_local EpochThread epochThread;
+
+  struct EpochGuard
+  {
+    EpochGuard()
+    {
+      if (epochThread.depth++ == 0)
+        epochThread.record->epoch.store(globalEpoch.load());
+    }
+
+    ~EpochGuard()
+    {
+      if (--epochThread.depth == 0)
+        epochThread.record->epoch.store(EpochIdle);
+    }
+  };
+
+  template <typename T>
+  static void destroy(void * pointer)
+  {
+    delete static_cast<T *>(pointer);
+  }
+
+  template <typename T>
+  static void retire(T * pointer)
+  {
+    if (!pointer)
+      return;
+
+    Retired retired = { pointer, &destroy<T>, globalEpoch.load() };
+    epochThread.retired.push_back(retired);
+
+    if (epochThread.retired.size() >= ReclaimThreshold)
+      epochThread.reclaim();
+  }
+
+  // -- Thread shared variables --
+
+  // Payloads are immutable once published, a write swaps in a new one. The value is detached
+  // so readers on any thread can share its text, numbers are kept parsed for incr. The text is
+  // taken before publishing, nothing reads the shared value in a way that could render into it.
+  struct TsvPayload
+  {
+    TsvPayload(Value const& value)
+      : value(value.detach()),
+        text(this->value.view()),
+        isNumber(value.asInt(number))
+    { }
+
+    Value value;
+    std::string_view text;
+    int64_t number;
+    bool isNumber;
+  };
+
+  struct TsvNode
+  {
+    TsvNode(std::string const& key, TsvPayload * payload)
+      : key(key),
+        payload(payload),
+        next(0)
+    { }
+
+    ~TsvNode()
+    {
+      delete payload.load();
+    }
+
+    std::string key;
+    std::atomic<TsvPayload *> payload;
+    std::atomic<TsvNode *> next;
+  };
+
+  // Shard locks only guard linking and unlinking nodes, values are replaced with a compare
+  // and swap so incr never waits for a lock.
+  static const size_t TsvShards = 64;
+  static const size_t TsvBuckets = 256;
+
+  struct TsvShard
+  {
+    std::mutex lock;
+    std::atomic<TsvNode *> buckets[TsvBuckets];
+  };
+
+  static TsvShard tsvShards[TsvShards];
+
+  static std::string tsvKey(Value const& array, Value const& element)
+  {
+    std::string key(array.view());
+    key += '\0';
+    key += element.view();
+    return key;
+  }
+
+  static std::atomic<TsvNode *> & tsvBucket(std::string const& key, TsvShard *& shard)
+  {
+    size_t hash = std::hash<std::string>()(key);
+    shard = &tsvShards[hash % TsvShards];
+    return shard->buckets[(hash / TsvShards) % TsvBuckets];
+  }
+
+  // Has to be called inside an epoch
+  static TsvNode * tsvFind(std::string const& key)
+  {
+    TsvShard * shard;
+    for (TsvNode * node = tsvBucket(key, shard).load(std::memory_order_acquire); node; node = node->next.load(std::memory_order_acquire))
+      if (node->key == key)
+        return node;
+    return 0;
+  }
+
+  // Replaces the payload of a node, the new one is built from the current one by update. An
+  // update returning null leaves the node alone. Returns false when the node was unset
+  // meanwhile, the caller looks it up again.
+  static bool tsvReplace(TsvNode * node, std::function<TsvPayload * (TsvPayload const* current)> const& update, Value & result)
+  {
+    TsvPayload * current = node->payload.load(std::memory_order_acquire);
+
+    while (current)
+    {
+      TsvPayload * next = update(current);
+      if (!next)
+        return true;
+
+      if (node->payload.compare_exchange_weak(current, next, std::memory_order_acq_rel))
+      {
+        result = next->value.detach();
+        retire(current);
+        return true;
+      }
+
+      delete next;
+    }
+
+    return false;
+  }
+
+  // Writes a value, creating the node under the shard lock if the key is new
+  static void tsvWrite(std::string const& key, Value const& initial, std::function<TsvPayload * (TsvPayload const* current)> const& update, Value & result)
+  {
+    EpochGuard guard;
+
+    while (true)
+    {
+      TsvNode * node = tsvFind(key);
+      if (node && tsvReplace(node, update, result))
+        return;
+
+      TsvShard * shard;
+      std::atomic<TsvNode *> & bucket = tsvBucket(key, shard);
+      std::lock_guard<std::mutex> lock(shard->lock);
+
+      if (tsvFind(key))
+        continue;
+
+      node = new TsvNode(key, new TsvPayload(initial));
+      node->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      bucket.store(node, std::memory_order_release);
+
+      result = node->payload.load()->value.detach();
+      return;
+    }
+  }
+
+  static bool tsvRead(std::string const& key, Value & result)
+  {
+    EpochGuard guard;
+
+    TsvNode * node = tsvFind(key);
+    TsvPayload * payload = node ? node->payload.load(std::memory_order_acquire) : 0;
+    if (!payload)
+      return false;
+
+    result = payload->value.detach();
+    return true;
+  }
+
+  // Looks for a live node the predicate matches, readers walk the buckets without taking a lock
+  static bool tsvAny(std::function<bool (std::string const& key)> const& matches)
+  {
+    EpochGuard guard;
+
+    for (size_t s = 0; s < TsvShards; ++s)
+      for (size_t b = 0; b < TsvBuckets; ++b)
+        for (TsvNode * node = tsvShards[s].buckets[b].load(std::memory_order_acquire); node; node = node->next.load(std::memory_order_acquire))
+          if (node->payload.load(std::memory_order_acquire) && matches(node->key))
+            return true;
+
+    return false;
+  }
+
+  // Unlinks every node the predicate matches, returns how many
+  static size_t tsvRemove(std::function<bool (std::string const& key)> const& matches)
+  {
+    EpochGuard guard;
+    size_t removed = 0;
+
+    for (size_t s = 0; s < TsvShards; ++s)
+    {
+      TsvShard & shard = tsvShards[s];
+      std::lock_guard<std::mutex> lock(shard.lock);
+
+      for (size_t b = 0; b < TsvBuckets; ++b)
+      {
+        std::atomic<TsvNode *> * link = &shard.buckets[b];
+
+        while (TsvNode * node = link->load(std::memory_order_relaxed))
+        {
+          if (!matches(node->key))
+          {
+            link = &node->next;
+            continue;
+          }
+
+          link->store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+          retire(node->payload.exchange(0));
+          retire(node);
+          ++removed;
+        }
+      }
+    }
+
+    return removed;
+  }
+
+  // tsv::set array element ?value?
+  ReturnCode builtInTsvSet(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() == 3)
+    {
+      if (!tsvRead(tsvKey(args[1], args[2]), ctx->current().result))
+        return ctx->reportError("No such element '" + args[2].str() + "' in shared array '" + args[1].str() + "'");
+      return RET_OK;
+    }
+
+    if (args.size() != 4)
+      return ctx->arityError(args[0].str());
+
+    Value const& value = args[3];
+    tsvWrite(tsvKey(args[1], args[2]), value, [&value](TsvPayload const*) { return new TsvPayload(value); }, ctx->current().result);
+    return RET_OK;
+  }
+
+  // tsv::get array element ?varName?
+  ReturnCode builtInTsvGet(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 3 && args.size() != 4)
+      return ctx->arityError(args[0].str());
+
+    Value value;
+    bool found = tsvRead(tsvKey(args[1], args[2]), value);
+
+    // With a variable a missing element is not an error, the result tells whether it was found
+    if (args.size() == 4)
+    {
+      if (found)
+        ctx->current().set(args[3].str(), value);
+      ctx->current().result.setInt(found ? 1 : 0);
+      return RET_OK;
+    }
+
+    if (!found)
+      return ctx->reportError("No such element '" + args[2].str() + "' in shared array '" + args[1].str() + "'");
+
+    ctx->current().result = value;
+    return RET_OK;
+  }
+
+  // tsv::incr array element ?increment?
+  ReturnCode builtInTsvIncr(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 3 && args.size() != 4)
+      return ctx->arityError(args[0].str());
+
+    int64_t increment = 1;
+    if (args.size() == 4 && !args[3].asInt(increment))
+      return ctx->reportError("Expected integer but got '" + args[3].str() + "'");
+
+    bool number = true;
+    tsvWrite(tsvKey(args[1], args[2]), Value::fromInt(increment),
+             [increment, &number](TsvPayload const* current) {
+               number = current->isNumber;
+               return number ? new TsvPayload(Value::fromInt(current->number + increment)) : 0;
+             },
+             ctx->current().result);
+
+    if (!number)
+      return ctx->reportError("Shared element '" + args[2].str() + "' of '" + args[1].str() + "' is not an integer");
+
+    return RET_OK;
+  }
+
+  // tsv::lappend array element value ?value ...?
+  ReturnCode builtInTsvLappend(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() < 4)
+      return ctx->arityError(args[0].str());
+
+    Value tail = Value::fromList(std::vector<Value>(args.begin() + 3, args.end()));
+    tail.str();
+
+    tsvWrite(tsvKey(args[1], args[2]), tail,
+             [&tail](TsvPayload const* current) {
+               std::string list(current->text);
+               if (!list.empty())
+                 list += ' ';
+               list += tail.str();
+               return new TsvPayload(Value(std::move(list)));
+             },
+             ctx->current().result);
+
+    return RET_OK;
+  }
+
+  // tsv::exists array ?element?, without an element whether the array has any
+  ReturnCode builtInTsvExists(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2 && args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    bool exists;
+    if (args.size() == 3)
+    {
+      Value value;
+      exists = tsvRead(tsvKey(args[1], args[2]), value);
+    }
+    else
+    {
+      std::string prefix(args[1].view());
+      prefix += '\0';
+      exists = tsvAny([&prefix](std::string const& key) { return key.compare(0, prefix.size(), prefix) == 0; });
+    }
+
+    ctx->current().result.setInt(exists ? 1 : 0);
+    return RET_OK;
+  }
+
+  // tsv::unset array ?element?
+  ReturnCode builtInTsvUnset(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() != 2 && args.size() != 3)
+      return ctx->arityError(args[0].str());
+
+    std::string key = args.size() == 3 ? tsvKey(args[1], args[2]) : args[1].str() + '\0';
+    const bool whole = args.size() == 2;
+
+    size_t removed = tsvRemove([&key, whole](std::string const& candidate) {
+      return whole ? candidate.compare(0, key.size(), key) == 0 : candidate == key;
+    });
+
+    if (removed == 0)
+      return ctx->reportError("No such shared " + std::string(whole ? "array '" : "element '") + args.back().str() + "'");
+
+    ctx->current().result = Value();
+    return RET_OK;
+  }
+
+}
@@ -0,0 +1,561 @@
+
+#include "TinyTcl.h"
+
+#include <cmath>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TCL_VECTOR_SSE2
+#endif
+
+namespace tcl {
+
+  extern double evalMinus(double a, double b);
+  extern double evalMul(double a, double b);
+  extern double evalDiv(double a, double b);
+  extern double evalAdd(double a, double b);
+  extern double evalSub(double a, double b);
+  extern double evalLess(double a, double b);
+  extern double evalGreater(double a, double b);
+  extern double evalEqual(double a, double b);
+  extern double evalNotEqual(double a, double b);
+  extern double evalLogicAnd(double a, double b);
+  extern double evalLogicOr(double a, double b);
+  extern CompiledExprPtr compileExpression(Context * ctx, std::string const& str);
+  extern bool evaluateVectorExpression(Context * ctx, CompiledExpr const& expr, NumberArrayPtr & result);
+
+  // -- Kernels --
+
+  // Every operator works on plain doubles and integers, and on two doubles at a time with SSE2.
+  // Integers only have an SSE2 version where the instruction set has one.
+
+#ifdef TCL_VECTOR_SSE2
+  static inline __m128d absolute(__m128d a)
+  {
+    return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+  }
+
+  static inline __m128d truth(__m128d mask)
+  {
+    return _mm_and_pd(mask, _mm_set1_pd(1.0));
+  }
+#endif
+
+  struct OpMinus
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return -a; }
+    static int64_t integer(int64_t a, int64_t b) { return -a; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+#endif
+  };
+
+  struct OpAdd
+  {
+    enum { IntSimd = 1 };
+    static double scalar(double a, double b) { return a + b; }
+    static int64_t integer(int64_t a, int64_t b) { return (int64_t)((uint64_t)a + (uint64_t)b); }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return _mm_add_pd(a, b); }
+    static __m128i simdInt(__m128i a, __m128i b) { return _mm_add_epi64(a, b); }
+#endif
+  };
+
+  struct OpSub
+  {
+    enum { IntSimd = 1 };
+    static double scalar(double a, double b) { return a - b; }
+    static int64_t integer(int64_t a, int64_t b) { return (int64_t)((uint64_t)a - (uint64_t)b); }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return _mm_sub_pd(a, b); }
+    static __m128i simdInt(__m128i a, __m128i b) { return _mm_sub_epi64(a, b); }
+#endif
+  };
+
+  struct OpMul
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return a * b; }
+    static int64_t integer(int64_t a, int64_t b) { return (int64_t)((uint64_t)a * (uint64_t)b); }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return _mm_mul_pd(a, b); }
+#endif
+  };
+
+  struct OpDiv
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return a / b; }
+    static int64_t integer(int64_t a, int64_t b) { return 0; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return _mm_div_pd(a, b); }
+#endif
+  };
+
+  struct OpLess
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return a < b ? 1.0 : 0.0; }
+    static int64_t integer(int64_t a, int64_t b) { return a < b; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return truth(_mm_cmplt_pd(a, b)); }
+#endif
+  };
+
+  struct OpGreater
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return a > b ? 1.0 : 0.0; }
+    static int64_t integer(int64_t a, int64_t b) { return a > b; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return truth(_mm_cmpgt_pd(a, b)); }
+#endif
+  };
+
+  struct OpEqual
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return evalEqual(a, b); }
+    static int64_t integer(int64_t a, int64_t b) { return a == b; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return truth(_mm_cmplt_pd(absolute(_mm_sub_pd(a, b)), _mm_set1_pd(0.0000001))); }
+#endif
+  };
+
+  struct OpNotEqual
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return evalNotEqual(a, b); }
+    static int64_t integer(int64_t a, int64_t b) { return a != b; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return truth(_mm_cmpgt_pd(absolute(_mm_sub_pd(a, b)), _mm_set1_pd(0.0000001))); }
+#endif
+  };
+
+  struct OpLogicAnd
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return a > 0.0 && b > 0.0 ? 1.0 : 0.0; }
+    static int64_t integer(int64_t a, int64_t b) { return a > 0 && b > 0; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return truth(_mm_and_pd(_mm_cmpgt_pd(a, _mm_setzero_pd()), _mm_cmpgt_pd(b, _mm_setzero_pd()))); }
+#endif
+  };
+
+  struct OpLogicOr
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return a > 0.0 || b > 0.0 ? 1.0 : 0.0; }
+    static int64_t integer(int64_t a, int64_t b) { return a > 0 || b > 0; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return truth(_mm_or_pd(_mm_cmpgt_pd(a, _mm_setzero_pd()), _mm_cmpgt_pd(b, _mm_setzero_pd()))); }
+#endif
+  };
+
+  struct OpMin
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return a < b ? a : b; }
+    static int64_t integer(int64_t a, int64_t b) { return a < b ? a : b; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return _mm_min_pd(a, b); }
+#endif
+  };
+
+  struct OpMax
+  {
+    enum { IntSimd = 0 };
+    static double scalar(double a, double b) { return a > b ? a : b; }
+    static int64_t integer(int64_t a, int64_t b) { return a > b ? a : b; }
+#ifdef TCL_VECTOR_SSE2
+    static __m128d simd(__m128d a, __m128d b) { return _mm_max_pd(a, b); }
+#endif
+  };
+
+  // A side with a single element is spread over every element of the other one
+  template <typename Op, bool SpreadA, bool SpreadB>
+  static void applyDoubles(double const* a, double const* b, double * out, size_t n)
+  {
+    size_t i = 0;
+
+#ifdef TCL_VECTOR_SSE2
+    const __m128d firstA = _mm_set1_pd(a[0]);
+    const __m128d firstB = _mm_set1_pd(b[0]);
+
+    for (; i + 2 <= n; i += 2)
+    {
+      __m128d x = SpreadA ? firstA : _mm_loadu_pd(a + i);
+      __m128d y = SpreadB ? firstB : _mm_loadu_pd(b + i);
+      _mm_storeu_pd(out + i, Op::simd(x, y));
+    }
+#endif
+
+    for (; i < n; ++i)
+      out[i] = Op::scalar(a[SpreadA ? 0 : i], b[SpreadB ? 0 : i]);
+  }
+
+  template <typename Op, bool SpreadA, bool SpreadB>
+  static void applyInts(int64_t const* a, int64_t const* b, int64_t * out, size_t n)
+  {
+    size_t i = 0;
+
+#ifdef TCL_VECTOR_SSE2
+    if constexpr (Op::IntSimd != 0)
+    {
+      const __m128i firstA = _mm_set1_epi64x(a[0]);
+      const __m128i firstB = _mm_set1_epi64x(b[0]);
+
+      for (; i + 2 <= n; i += 2)
+      {
+        __m128i x = SpreadA ? firstA : _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i y = SpreadB ? firstB : _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), Op::simdInt(x, y));
+      }
+    }
+#endif
+
+    for (; i < n; ++i)
+      out[i] = Op::integer(a[SpreadA ? 0 : i], b[SpreadB ? 0 : i]);
+  }
+
+  template <typename Op>
+  static void apply(NumberArray const& a, NumberArray const& b, NumberArray & out, size_t n)
+  {
+    const bool spreadA = a.size() != n;
+    const bool spreadB = b.size() != n;
+
+    if (out.isInt)
+    {
+      out.ints.resize(n);
+      int64_t const* x = a.ints.data();
+      int64_t const* y = b.ints.data();
+
+      if (spreadA)
+        applyInts<Op, true, false>(x, y, out.ints.data(), n);
+      else if (spreadB)
+        applyInts<Op, false, true>(x, y, out.ints.data(), n);
+      else
+        applyInts<Op, false, false>(x, y, out.ints.data(), n);
+      return;
+    }
+
+    // Integers meeting doubles are converted first
+    std::vector<double> convertedA, convertedB;
+    if (a.isInt)
+      convertedA.assign(a.ints.begin(), a.ints.end());
+    if (b.isInt)
+      convertedB.assign(b.ints.begin(), b.ints.end());
+
+    double const* x = a.isInt ? convertedA.data() : a.doubles.data();
+    double const* y = b.isInt ? convertedB.data() : b.doubles.data();
+    out.doubles.resize(n);
+
+    if (spreadA)
+      applyDoubles<Op, true, false>(x, y, out.doubles.data(), n);
+    else if (spreadB)
+      applyDoubles<Op, false, true>(x, y, out.doubles.data(), n);
+    else
+      applyDoubles<Op, false, false>(x, y, out.doubles.data(), n);
+  }
+
+  static bool combinedSize(Context * ctx, NumberArray const& a, NumberArray const& b, size_t & n)
+  {
+    if (a.size() == b.size() || b.size() == 1)
+      n = a.size();
+    else if (a.size() == 1)
+      n = b.size();
+    else
+    {
+      ctx->reportError("Lists of different length " + std::to_string(a.size()) + " and " + std::to_string(b.size()));
+      return false;
+    }
+
+    return true;
+  }
+
+  // Applies one of the expression operators element by element, null on error
+  NumberArrayPtr vectorApply(Context * ctx, double (*eval)(double a, double b), NumberArrayPtr const& a, NumberArrayPtr const& b)
+  {
+    size_t n;
+    if (!combinedSize(ctx, *a, *b, n))
+      return NumberArrayPtr();
+
+    std::shared_ptr<NumberArray> out = std::make_shared<NumberArray>();
+    out->isInt = a->isInt && b->isInt && eval != evalDiv;
+
+    if (n == 0)
+      return out;
+
+    if (eval == evalMinus)
+      apply<OpMinus>(*a, *b, *out, n);
+    else if (eval == evalMul)
+      apply<OpMul>(*a, *b, *out, n);
+    else if (eval == evalDiv)
+      apply<OpDiv>(*a, *b, *out, n);
+    else if (eval == evalAdd)
+      apply<OpAdd>(*a, *b, *out, n);
+    else if (eval == evalSub)
+      apply<OpSub>(*a, *b, *out, n);
+    else if (eval == evalLess)
+      apply<OpLess>(*a, *b, *out, n);
+    else if (eval == evalGreater)
+      apply<OpGreater>(*a, *b, *out, n);
+    else if (eval == evalEqual)
+      apply<OpEqual>(*a, *b, *out, n);
+    else if (eval == evalNotEqual)
+      apply<OpNotEqual>(*a, *b, *out, n);
+    else if (eval == evalLogicAnd)
+      apply<OpLogicAnd>(*a, *b, *out, n);
+    else if (eval == evalLogicOr)
+      apply<OpLogicOr>(*a, *b, *out, n);
+    else
+    {
+      ctx->reportError("Operator can not be applied to lists");
+      return NumberArrayPtr();
+    }
+
+    return out;
+  }
+
+  // Element wise condition ? a : b
+  NumberArrayPtr vectorSelect(Context * ctx, NumberArrayPtr const& condition, NumberArrayPtr const& a, NumberArrayPtr const& b)
+  {
+    const size_t n = std::max(condition->size(), std::max(a->size(), b->size()));
+    NumberArray const* sides[] = { condition.get(), a.get(), b.get() };
+
+    for (int i = 0; i < 3; ++i)
+    {
+      if (sides[i]->size() != n && sides[i]->size() != 1)
+      {
+        ctx->reportError("Lists of different length " + std::to_string(sides[i]->size()) + " and " + std::to_string(n));
+        return NumberArrayPtr();
+      }
+    }
+
+    std::shared_ptr<NumberArray> out = std::make_shared<NumberArray>();
+    out->isInt = a->isInt && b->isInt;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      NumberArray const& from = condition->at(condition->size() == 1 ? 0 : i) > 0.0 ? *a : *b;
+      const size_t index = from.size() == 1 ? 0 : i;
+
+      if (out->isInt)
+        out->ints.push_back(from.ints[index]);
+      else
+        out->doubles.push_back(from.at(index));
+    }
+
+    return out;
+  }
+
+  // -- Reductions --
+
+  static double sumDoubles(double const* a, size_t n)
+  {
+    size_t i = 0;
+    double total = 0.0;
+
+#ifdef TCL_VECTOR_SSE2
+    __m128d first = _mm_setzero_pd(), second = _mm_setzero_pd();
+    for (; i + 4 <= n; i += 4)
+    {
+      first = _mm_add_pd(first, _mm_loadu_pd(a + i));
+      second = _mm_add_pd(second, _mm_loadu_pd(a + i + 2));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(first, second));
+    total = lanes[0] + lanes[1];
+#endif
+
+    for (; i < n; ++i)
+      total += a[i];
+    return total;
+  }
+
+  static double dotDoubles(double const* a, double const* b, size_t n)
+  {
+    size_t i = 0;
+    double total = 0.0;
+
+#ifdef TCL_VECTOR_SSE2
+    __m128d first = _mm_setzero_pd(), second = _mm_setzero_pd();
+    for (; i + 4 <= n; i += 4)
+    {
+      first = _mm_add_pd(first, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+      second = _mm_add_pd(second, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(first, second));
+    total = lanes[0] + lanes[1];
+#endif
+
+    for (; i < n; ++i)
+      total += a[i] * b[i];
+    return total;
+  }
+
+  template <typename Op>
+  static double reduceDoubles(double const* a, size_t n)
+  {
+    size_t i = 1;
+    double result = a[0];
+
+#ifdef TCL_VECTOR_SSE2
+    if (n >= 2)
+    {
+      __m128d lanes = _mm_loadu_pd(a);
+      for (i = 2; i + 2 <= n; i += 2)
+        lanes = Op::simd(lanes, _mm_loadu_pd(a + i));
+
+      double pair[2];
+      _mm_storeu_pd(pair, lanes);
+      result = Op::scalar(pair[0], pair[1]);
+    }
+#endif
+
+    for (; i < n; ++i)
+      result = Op::scalar(result, a[i]);
+    return result;
+  }
+
+  template <typename Op>
+  static int64_t reduceInts(int64_t const* a, size_t n)
+  {
+    int64_t result = a[0];
+    for (size_t i = 1; i < n; ++i)
+      result = Op::integer(result, a[i]);
+    return result;
+  }
+
+  static Value reduce(Context * ctx, std::string const& name, NumberArray const& a)
+  {
+    if (name == "sum")
+    {
+      if (a.isInt)
+      {
+        int64_t total = 0;
+        for (size_t i = 0; i < a.ints.size(); ++i)
+          total = OpAdd::integer(total, a.ints[i]);
+        return Value::fromInt(total);
+      }
+      return Value::fromDouble(sumDoubles(a.doubles.data(), a.doubles.size()));
+    }
+
+    if (a.size() == 0)
+    {
+      ctx->reportError("Can not take the " + name + " of an empty list");
+      return Value();
+    }
+
+    if (name == "min")
+      return a.isInt ? Value::fromInt(reduceInts<OpMin>(a.ints.data(), a.ints.size())) : Value::fromDouble(reduceDoubles<OpMin>(a.doubles.data(), a.doubles.size()));
+
+    return a.isInt ? Value::fromInt(reduceInts<OpMax>(a.ints.data(), a.ints.size())) : Value::fromDouble(reduceDoubles<OpMax>(a.doubles.data(), a.doubles.size()));
+  }
+
+  static Value dot(Context * ctx, NumberArray const& a, NumberArray const& b)
+  {
+    if (a.size() != b.size())
+    {
+      ctx->reportError("Lists of different length " + std::to_string(a.size()) + " and " + std::to_string(b.size()));
+      return Value();
+    }
+
+    if (a.isInt && b.isInt)
+    {
+      int64_t total = 0;
+      for (size_t i = 0; i < a.ints.size(); ++i)
+        total = OpAdd::integer(total, OpMul::integer(a.ints[i], b.ints[i]));
+      return Value::fromInt(total);
+    }
+
+    std::vector<double> convertedA, convertedB;
+    if (a.isInt)
+      convertedA.assign(a.ints.begin(), a.ints.end());
+    if (b.isInt)
+      convertedB.assign(b.ints.begin(), b.ints.end());
+
+    return Value::fromDouble(dotDoubles(a.isInt ? convertedA.data() : a.doubles.data(), b.isInt ? convertedB.data() : b.doubles.data(), a.size()));
+  }
+
+  // -- Vector expressions --
+
+  static bool evaluateVector(Context * ctx, Value const& str, NumberArrayPtr & result)
+  {
+    ctx->reportError("");
+    CompiledExprPtr expr = compileExpression(ctx, str.str());
+    if (!expr || !evaluateVectorExpression(ctx, *expr, result))
+    {
+      if (ctx->error.empty())
+        ctx->reportError("Could not evaluate '" + str.str() + "'");
+      return false;
+    }
+
+    return true;
+  }
+
+  // vexpr expression
+  // vexpr sum|min|max expression
+  // vexpr min|max|dot expression expression
+  ReturnCode builtInVexpr(Context * ctx, ArgumentVector const& args, void * data)
+  {
+    if (args.size() < 2 || args.size() > 4)
+      return ctx->arityError(args[0].str());
+
+    NumberArrayPtr a, b;
+
+    if (args.size() == 2)
+    {
+      if (!evaluateVector(ctx, args[1], a))
+        return ctx->failure();
+
+      ctx->current().result = Value::fromNumbers(a);
+      return RET_OK;
+    }
+
+    std::string const& name = args[1].str();
+    if (name != "sum" && name != "min" && name != "max" && name != "dot")
+      return ctx->reportError("Unknown vexpr function '" + name + "', should be sum, min, max or dot");
+
+    if (!evaluateVector(ctx, args[2], a) || (args.size() == 4 && !evaluateVector(ctx, args[3], b)))
+      return ctx->failure();
+
+    ctx->reportError("");
+
+    if (args.size() == 3)
+    {
+      if (name == "dot")
+        return ctx->arityError(args[0].str());
+      ctx->current().result = reduce(ctx, name, *a);
+    }
+    else if (name == "dot")
+      ctx->current().result = dot(ctx, *a, *b);
+    else if (name == "min" || name == "max")
+    {
+      size_t n;
+      if (!combinedSize(ctx, *a, *b, n))
+        return RET_ERROR;
+
+      std::shared_ptr<NumberArray> out = std::make_shared<NumberArray>();
+      out->isInt = a->isInt && b->isInt;
+      if (n > 0)
+      {
+        if (name == "min")
+          apply<OpMin>(*a, *b, *out, n);
+        else
+          apply<OpMax>(*a, *b, *out, n);
+      }
+      ctx->current().result = Value::fromNumbers(out);
+    }
+    else
+      return ctx->arityError(args[0].str());
+
+    return ctx->error.empty() ? RET_OK : RET_ERROR;
+  }
+
+}